@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "phone.h"
+
+// The face is built into the benchmark so its static functions can be timed
+#define main face_main
+#include "../src/simplicity.c"
+#undef main
+
+// Host benchmarks of the face's hot paths. Each reports the best ns/op of a
+// few runs, and user space instructions per op where perf events are allowed.
+// Instructions are the stable figure, so the regression check uses them when
+// both the run and the baseline have them and ns/op otherwise.
+//
+//   bench [baseline] [--update] [--threshold percent] [--ns-threshold percent]
+//
+// Without --update a benchmark slower than its baseline by more than the
+// threshold fails the run: 10% more instructions, or 25% more time where
+// instructions are not counted. With --update the baseline is written.
+
+#define BENCH_EPOCH 1717977600 // Monday 10 June 2024, midnight UTC
+#define BENCH_MIN_NS 20000000
+#define BENCH_RUNS 5
+#define BENCH_MAX 16
+
+typedef struct {
+  const char *name;
+  void (*setup)(void);
+  void (*run)(uint32_t i);
+} Bench;
+
+typedef struct {
+  char name[48];
+  double ns;
+  double instructions;
+} Result;
+
+static volatile uint32_t sink;
+static int perf_fd = -1;
+
+// Instructions
+
+static void perf_open(void) {
+  struct perf_event_attr attr = {
+    .type = PERF_TYPE_HARDWARE,
+    .size = sizeof(attr),
+    .config = PERF_COUNT_HW_INSTRUCTIONS,
+    .disabled = 1,
+    .exclude_kernel = 1,
+    .exclude_hv = 1
+  };
+  perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_start(void) {
+  if (perf_fd < 0)
+    return;
+  ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+  ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static double perf_stop(void) {
+  uint64_t count;
+  if (perf_fd < 0)
+    return -1;
+  ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+  if (read(perf_fd, &count, sizeof(count)) != sizeof(count))
+    return -1;
+  return count;
+}
+
+static int64_t now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// Benchmarks
+
+static char date_text[START_DATE_SIZE + 8];
+
+static void modify_hit_run(uint32_t i) {
+  modify_calendar_time(date_text, sizeof(date_text), BENCH_EPOCH + (i % 10) * DAY_SECONDS + 9 * 3600, i % 5 == 0);
+  sink += date_text[0];
+}
+
+// A new day, so today's day number is worked out again with localtime
+static void modify_miss_run(uint32_t i) {
+  g_last_tm_mday = -1;
+  modify_hit_run(i);
+}
+
+static const char *const numbers[] = { "0", "7", "12", "59", "2024", "11/", "30 " };
+
+static void a_to_i_run(uint32_t i) {
+  const char *number = numbers[i % ARRAY_LENGTH(numbers)];
+  sink += a_to_i(number, strlen(number));
+}
+
+// Every minute of the day after the epoch, as localtime gives them
+static struct tm minutes[24 * 60];
+
+static void tick_setup(void) {
+  for (int i = 0; i < 24 * 60; i++) {
+    time_t t = BENCH_EPOCH + DAY_SECONDS + i * 60;
+    minutes[i] = *localtime(&t);
+  }
+}
+
+static void tick_12h_setup(void) {
+  tick_setup();
+  sim_set_24h(false);
+}
+
+static void tick_24h_setup(void) {
+  tick_setup();
+  sim_set_24h(true);
+}
+
+static void tick_run(uint32_t i) {
+  tick_minute(&minutes[i % (24 * 60)]);
+}
+
+// The first calendar message of a phone with 20 events, 30 character titles
+// and 15 character locations, as check_records and decode_event see it
+static uint8_t records[2048];
+static uint16_t records_size;
+
+static void keep_records(const uint8_t *data, uint16_t size) {
+  DictionaryIterator iter;
+  static uint8_t copy[4096];
+  memcpy(copy, data, size);
+  Tuple *tuple = dict_read_begin_from_buffer(&iter, copy, size);
+  for (; tuple; tuple = dict_read_next(&iter)) {
+    if (tuple->key == CALENDAR_RESPONSE_V2_KEY && records_size == 0 && tuple->length <= sizeof(records)) {
+      memcpy(records, tuple->value->data, tuple->length);
+      records_size = tuple->length;
+    }
+  }
+}
+
+static void decode_setup(void) {
+  sim_set_inbox_hook(keep_records);
+  phone_make_calendar(BENCH_EPOCH, 20, 30, 15);
+  phone_push_calendar();
+  sim_run(1000);
+  sim_set_inbox_hook(NULL);
+}
+
+static void decode_run(uint32_t i) {
+  int count = records[0];
+  const uint8_t *data = &records[1];
+  if (!check_records(CALENDAR_FORMAT_V2, data, records_size - 1, count))
+    abort();
+  for (int n = 0; n < count; n++) {
+    uint8_t index;
+    Event record;
+    EventText text;
+    data += decode_event(CALENDAR_FORMAT_V2, data, &index, &record, &text);
+    sink += record.start;
+  }
+}
+
+static const Bench benches[] = {
+  { "modify_calendar_time_hit", NULL, modify_hit_run },
+  { "modify_calendar_time_miss", NULL, modify_miss_run },
+  { "a_to_i", NULL, a_to_i_run },
+  { "tick_minute_12h", tick_12h_setup, tick_run },
+  { "tick_minute_24h", tick_24h_setup, tick_run },
+  { "decode_calendar_20", decode_setup, decode_run },
+};
+
+// Best of BENCH_RUNS, each long enough to read the clock well
+static Result measure(const Bench *bench) {
+  Result result = { .ns = -1, .instructions = -1 };
+  snprintf(result.name, sizeof(result.name), "%s", bench->name);
+  if (bench->setup)
+    bench->setup();
+
+  uint32_t n = 1;
+  while (1) {
+    int64_t start = now_ns();
+    for (uint32_t i = 0; i < n; i++)
+      bench->run(i);
+    if (now_ns() - start >= BENCH_MIN_NS || n >= (1u << 30))
+      break;
+    n *= 2;
+  }
+  for (int r = 0; r < BENCH_RUNS; r++) {
+    perf_start();
+    int64_t start = now_ns();
+    for (uint32_t i = 0; i < n; i++)
+      bench->run(i);
+    double ns = (double)(now_ns() - start) / n;
+    double instructions = perf_stop();
+    if (result.ns < 0 || ns < result.ns)
+      result.ns = ns;
+    if (instructions >= 0 && (result.instructions < 0 || instructions / n < result.instructions))
+      result.instructions = instructions / n;
+  }
+  return result;
+}
+
+// Baselines, one "name ns/op instructions/op" line each, -1 for unknown
+
+static int read_baseline(const char *path, Result *baseline) {
+  FILE *in = fopen(path, "r");
+  int count = 0;
+  char line[128];
+  if (!in)
+    return 0;
+  while (count < BENCH_MAX && fgets(line, sizeof(line), in)) {
+    Result *r = &baseline[count];
+    if (line[0] != '#' && sscanf(line, "%47s %lf %lf", r->name, &r->ns, &r->instructions) == 3)
+      count++;
+  }
+  fclose(in);
+  return count;
+}
+
+static bool write_baseline(const char *path, const Result *results, int count) {
+  FILE *out = fopen(path, "w");
+  if (!out)
+    return false;
+  fprintf(out, "# Written by bench --update: name, ns/op, instructions/op (-1 when not counted)\n");
+  for (int i = 0; i < count; i++)
+    fprintf(out, "%s %.1f %.0f\n", results[i].name, results[i].ns, results[i].instructions);
+  fclose(out);
+  return true;
+}
+
+static const Result *find(const Result *results, int count, const char *name) {
+  for (int i = 0; i < count; i++) {
+    if (strcmp(results[i].name, name) == 0)
+      return &results[i];
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  const char *path = NULL;
+  bool update = false;
+  double threshold = 10;
+  double ns_threshold = 25;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--update") == 0)
+      update = true;
+    else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+      threshold = atof(argv[++i]);
+    else if (strcmp(argv[i], "--ns-threshold") == 0 && i + 1 < argc)
+      ns_threshold = atof(argv[++i]);
+    else
+      path = argv[i];
+  }
+
+  setenv("TZ", "UTC", 1);
+  tzset();
+  perf_open();
+  sim_set_phone(phone_handle);
+  phone_make_calendar(BENCH_EPOCH, 12, 24, 12);
+  sim_start(BENCH_EPOCH, false);
+  sim_run(5000);
+
+  Result baseline[BENCH_MAX];
+  int baseline_count = path && !update ? read_baseline(path, baseline) : 0;
+  Result results[ARRAY_LENGTH(benches)];
+  int regressions = 0;
+
+  printf("%-28s %10s %12s %10s\n", "benchmark", "ns/op", "instr/op", "change");
+  for (size_t i = 0; i < ARRAY_LENGTH(benches); i++) {
+    Result *r = &results[i];
+    *r = measure(&benches[i]);
+    const Result *base = find(baseline, baseline_count, r->name);
+    char change[32] = "";
+    if (base) {
+      bool by_instructions = r->instructions >= 0 && base->instructions > 0;
+      double now = by_instructions ? r->instructions : r->ns;
+      double was = by_instructions ? base->instructions : base->ns;
+      double percent = (now - was) * 100 / was;
+      bool regressed = percent > (by_instructions ? threshold : ns_threshold);
+      regressions += regressed;
+      snprintf(change, sizeof(change), "%+.1f%%%s%s", percent, by_instructions ? "" : " ns", regressed ? " !" : "");
+    }
+    if (r->instructions >= 0)
+      printf("%-28s %10.1f %12.0f %10s\n", r->name, r->ns, r->instructions, change);
+    else
+      printf("%-28s %10.1f %12s %10s\n", r->name, r->ns, "n/a", change);
+  }
+  sim_stop();
+
+  if (update) {
+    if (!path || !write_baseline(path, results, ARRAY_LENGTH(benches))) {
+      fprintf(stderr, "bench: cannot write the baseline %s\n", path ? path : "(none given)");
+      return 2;
+    }
+    printf("baseline written to %s\n", path);
+    return 0;
+  }
+  if (path && baseline_count == 0)
+    printf("no baseline in %s, run with --update to write one\n", path);
+  if (regressions)
+    printf("%d benchmark(s) regressed past the threshold\n", regressions);
+  return regressions != 0;
+}
@@ -0,0 +1,1188 @@
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sim.h"
+#include "trace.h"
+
+// Stub SDK behind pebble.h. Layers and messages come from fixed pools, as on
+// the watch they live in firmware memory. Timers are taken from the face's
+// heap like the firmware takes them from the app heap, so the heap holds what
+// the face allocated itself and the timers it has armed.
+
+#define SIM_LAYERS 32
+#define SIM_TIMERS 32
+#define SIM_BITMAPS 16
+#define SIM_PERSIST_KEYS 64
+#define SIM_PERSIST_TOTAL 4096
+#define SIM_INBOX_MAX 2026
+#define SIM_OUTBOX_MAX 656
+#define SIM_PENDING_INBOX 16
+#define SIM_LAYER_DATA 16
+
+SimCounters sim_counters;
+
+struct GContext { GCompOp mode; };
+struct GBitmap { bool used; GRect bounds; };
+struct GFont { int unused; };
+
+struct Layer {
+  bool used;
+  bool hidden;
+  GRect frame;
+  LayerUpdateProc update_proc;
+  Layer *parent;
+  Layer *first_child;
+  Layer *next_sibling;
+  TextLayer *text_layer;
+  uint8_t data[SIM_LAYER_DATA];
+};
+
+struct TextLayer {
+  Layer *layer;
+  const char *text;
+};
+
+struct Window {
+  Layer *root;
+  bool used;
+};
+
+struct AppTimer {
+  int64_t due_ms;
+  uint32_t order;
+  AppTimerCallback callback;
+  void *data;
+};
+
+typedef struct {
+  bool used;
+  uint32_t key;
+  uint16_t size;
+  uint8_t data[PERSIST_DATA_MAX_LENGTH];
+} PersistEntry;
+
+typedef struct {
+  bool used;
+  int64_t due_ms;
+  uint32_t order;
+  uint16_t size;
+  uint8_t data[SIM_INBOX_MAX];
+} PendingInbox;
+
+static int64_t now_ms;
+static uint32_t event_order;
+static bool log_enabled;
+// Face call under way that must not allocate, NULL outside of them
+static const char *no_alloc_in;
+static const char inbox_handler[] = "the inbox handler";
+static bool frame_pending;
+static Window *top_window;
+
+static Layer layers[SIM_LAYERS];
+static TextLayer text_layers[SIM_LAYERS];
+static Window windows[2];
+static GBitmap bitmaps[SIM_BITMAPS];
+static struct GFont system_font;
+static AppTimer *timers[SIM_TIMERS];
+static PersistEntry persist[SIM_PERSIST_KEYS];
+
+static TickHandler tick_handler;
+static TimeUnits tick_units;
+static BluetoothConnectionHandler bluetooth_handler;
+static BatteryStateHandler battery_handler;
+static AccelTapHandler tap_handler;
+static bool bluetooth_connected;
+static BatteryChargeState battery_state;
+static bool clock_24h;
+
+static AppMessageInboxReceived inbox_received;
+static AppMessageInboxDropped inbox_dropped;
+static AppMessageOutboxSent outbox_sent;
+static AppMessageOutboxFailed outbox_failed;
+static uint32_t inbox_size;
+static uint32_t outbox_size;
+static uint8_t outbox_buffer[SIM_OUTBOX_MAX];
+static DictionaryIterator outbox_iter;
+static bool outbox_open;
+static bool outbox_in_flight;
+static int64_t outbox_due_ms;
+static AppMessageResult outbox_result;
+static PendingInbox pending_inbox[SIM_PENDING_INBOX];
+static uint32_t latency_ms = 100;
+static int refused_sends;
+static AppMessageResult refused_result;
+static SimPhone phone;
+static SimInboxHook inbox_hook;
+
+// Clock
+
+time_t sim_time(time_t *t) {
+  time_t now = now_ms / 1000;
+  if (t)
+    *t = now;
+  return now;
+}
+
+uint16_t time_ms(time_t *t, uint16_t *ms) {
+  uint16_t part = now_ms % 1000;
+  if (t)
+    *t = now_ms / 1000;
+  if (ms)
+    *ms = part;
+  return part;
+}
+
+time_t sim_now(void) {
+  return now_ms / 1000;
+}
+
+int64_t sim_now_ms(void) {
+  return now_ms;
+}
+
+// Capture, in the record format of src/trace.h. Dictionaries are kept whole
+// whatever their size, and the host cannot tell the outbox requests apart,
+// so sends and their results are recorded as request 0.
+
+static FILE *capture;
+static int64_t capture_last_ms;
+
+static void capture_header(uint8_t type, uint16_t delta_ms, uint16_t length) {
+  uint8_t header[TRACE_HEADER_SIZE] = { type, delta_ms & 0xff, delta_ms >> 8, length & 0xff, length >> 8 };
+  fwrite(header, 1, sizeof(header), capture);
+}
+
+static void capture_record(uint8_t type, const void *data, uint16_t length) {
+  if (!capture)
+    return;
+  if (capture_last_ms < 0 || now_ms - capture_last_ms > UINT16_MAX) {
+    uint32_t seconds = now_ms / 1000;
+    uint16_t ms = now_ms % 1000;
+    uint8_t clock[6] = { seconds & 0xff, seconds >> 8 & 0xff, seconds >> 16 & 0xff, seconds >> 24,
+                         ms & 0xff, ms >> 8 };
+    capture_header(TRACE_CLOCK, 0, sizeof(clock));
+    fwrite(clock, 1, sizeof(clock), capture);
+    capture_last_ms = now_ms;
+  }
+  capture_header(type, now_ms - capture_last_ms, length);
+  fwrite(data, 1, length, capture);
+  capture_last_ms = now_ms;
+}
+
+static void capture_result(uint8_t type, AppMessageResult result) {
+  uint8_t payload[3] = { 0, result & 0xff, result >> 8 & 0xff };
+  capture_record(type, payload, type == TRACE_FAILED ? 3 : 1);
+}
+
+void sim_capture(FILE *out) {
+  capture = out;
+  capture_last_ms = -1;
+}
+
+void app_log(uint8_t log_level, const char *src_filename, int src_line_number, const char *fmt, ...) {
+  if (!log_enabled)
+    return;
+  va_list args;
+  va_start(args, fmt);
+  fprintf(stderr, "[%lld] %s:%d ", (long long)now_ms, src_filename, src_line_number);
+  vfprintf(stderr, fmt, args);
+  fputc('\n', stderr);
+  va_end(args);
+}
+
+void sim_set_log(bool enabled) {
+  log_enabled = enabled;
+}
+
+// Graphics, nothing is drawn
+
+GFont fonts_get_system_font(const char *font_key) {
+  return &system_font;
+}
+
+void graphics_context_set_stroke_color(GContext *ctx, GColor color) {}
+void graphics_context_set_fill_color(GContext *ctx, GColor color) {}
+
+void graphics_context_set_compositing_mode(GContext *ctx, GCompOp mode) {
+  ctx->mode = mode;
+}
+
+void graphics_draw_line(GContext *ctx, GPoint p0, GPoint p1) {}
+void graphics_fill_rect(GContext *ctx, GRect rect, uint16_t corner_radius, GCornerMask corner_mask) {}
+void graphics_draw_bitmap_in_rect(GContext *ctx, const GBitmap *bitmap, GRect rect) {}
+void graphics_draw_text(GContext *ctx, const char *text, GFont const font, const GRect box,
+                        const GTextOverflowMode overflow_mode, const GTextAlignment alignment,
+                        const GTextLayoutCacheRef layout) {}
+
+static GBitmap *bitmap_alloc(GRect bounds) {
+  for (int i = 0; i < SIM_BITMAPS; i++) {
+    if (!bitmaps[i].used) {
+      bitmaps[i] = (GBitmap) { .used = true, .bounds = bounds };
+      return &bitmaps[i];
+    }
+  }
+  return NULL;
+}
+
+GBitmap *gbitmap_create_with_resource(uint32_t resource_id) {
+  return bitmap_alloc(GRect(0, 0, 144, 168));
+}
+
+GBitmap *gbitmap_create_as_sub_bitmap(const GBitmap *base_bitmap, GRect sub_rect) {
+  return bitmap_alloc(sub_rect);
+}
+
+void gbitmap_destroy(GBitmap *bitmap) {
+  if (bitmap)
+    bitmap->used = false;
+}
+
+// Layers. Marking any layer dirty redraws the whole window, as on the watch.
+
+Layer *layer_create(GRect frame) {
+  for (int i = 0; i < SIM_LAYERS; i++) {
+    if (!layers[i].used) {
+      layers[i] = (Layer) { .used = true, .frame = frame };
+      return &layers[i];
+    }
+  }
+  return NULL;
+}
+
+Layer *layer_create_with_data(GRect frame, size_t data_size) {
+  return data_size <= SIM_LAYER_DATA ? layer_create(frame) : NULL;
+}
+
+void layer_destroy(Layer *layer) {
+  if (!layer)
+    return;
+  if (layer->parent) {
+    Layer **link = &layer->parent->first_child;
+    while (*link != layer)
+      link = &(*link)->next_sibling;
+    *link = layer->next_sibling;
+  }
+  for (Layer *child = layer->first_child; child; child = child->next_sibling)
+    child->parent = NULL;
+  layer->used = false;
+}
+
+void layer_mark_dirty(Layer *layer) {
+  frame_pending = true;
+}
+
+void layer_set_update_proc(Layer *layer, LayerUpdateProc update_proc) {
+  layer->update_proc = update_proc;
+}
+
+void layer_set_frame(Layer *layer, GRect frame) {
+  layer->frame = frame;
+  frame_pending = true;
+}
+
+GRect layer_get_frame(const Layer *layer) {
+  return layer->frame;
+}
+
+GRect layer_get_bounds(const Layer *layer) {
+  return (GRect) { { 0, 0 }, layer->frame.size };
+}
+
+void layer_set_hidden(Layer *layer, bool hidden) {
+  if (layer->hidden == hidden)
+    return;
+  layer->hidden = hidden;
+  frame_pending = true;
+}
+
+bool layer_get_hidden(const Layer *layer) {
+  return layer->hidden;
+}
+
+void layer_add_child(Layer *parent, Layer *child) {
+  Layer **link = &parent->first_child;
+  while (*link)
+    link = &(*link)->next_sibling;
+  *link = child;
+  child->parent = parent;
+  child->next_sibling = NULL;
+  frame_pending = true;
+}
+
+void *layer_get_data(const Layer *layer) {
+  return (void *)layer->data;
+}
+
+TextLayer *text_layer_create(GRect frame) {
+  Layer *layer = layer_create(frame);
+  if (!layer)
+    return NULL;
+  TextLayer *text_layer = &text_layers[layer - layers];
+  *text_layer = (TextLayer) { .layer = layer };
+  layer->text_layer = text_layer;
+  return text_layer;
+}
+
+void text_layer_destroy(TextLayer *text_layer) {
+  if (text_layer)
+    layer_destroy(text_layer->layer);
+}
+
+Layer *text_layer_get_layer(TextLayer *text_layer) {
+  return text_layer->layer;
+}
+
+void text_layer_set_text(TextLayer *text_layer, const char *text) {
+  text_layer->text = text;
+  frame_pending = true;
+}
+
+const char *text_layer_get_text(TextLayer *text_layer) {
+  return text_layer->text;
+}
+
+void text_layer_set_background_color(TextLayer *text_layer, GColor color) {
+  frame_pending = true;
+}
+
+void text_layer_set_text_color(TextLayer *text_layer, GColor color) {
+  frame_pending = true;
+}
+
+void text_layer_set_overflow_mode(TextLayer *text_layer, GTextOverflowMode line_mode) {}
+void text_layer_set_font(TextLayer *text_layer, GFont font) {}
+void text_layer_set_text_alignment(TextLayer *text_layer, GTextAlignment text_alignment) {}
+
+Window *window_create(void) {
+  for (int i = 0; i < (int)ARRAY_LENGTH(windows); i++) {
+    if (!windows[i].used) {
+      windows[i] = (Window) { .used = true, .root = layer_create(GRect(0, 0, 144, 168)) };
+      return &windows[i];
+    }
+  }
+  return NULL;
+}
+
+void window_destroy(Window *window) {
+  if (window == top_window)
+    top_window = NULL;
+  layer_destroy(window->root);
+  window->used = false;
+}
+
+Layer *window_get_root_layer(const Window *window) {
+  return window->root;
+}
+
+void window_set_background_color(Window *window, GColor background_color) {
+  frame_pending = true;
+}
+
+Window *window_stack_get_top_window(void) {
+  return top_window;
+}
+
+void window_stack_push(Window *window, bool animated) {
+  top_window = window;
+  frame_pending = true;
+}
+
+static void draw_layer(Layer *layer, GContext *ctx) {
+  if (layer->hidden)
+    return;
+  if (layer->update_proc) {
+    sim_counters.layer_draws++;
+    no_alloc_in = "a layer update proc";
+    layer->update_proc(layer, ctx);
+    no_alloc_in = NULL;
+  }
+  for (Layer *child = layer->first_child; child; child = child->next_sibling)
+    draw_layer(child, ctx);
+}
+
+static void render(void) {
+  if (!frame_pending || !top_window)
+    return;
+  frame_pending = false;
+  sim_counters.redraws++;
+  GContext ctx = { GCompOpAssign };
+  draw_layer(top_window->root, &ctx);
+}
+
+const char *sim_text_at(int16_t x, int16_t y) {
+  for (int i = 0; i < SIM_LAYERS; i++) {
+    if (layers[i].used && layers[i].text_layer && layers[i].frame.origin.x == x && layers[i].frame.origin.y == y)
+      return layers[i].text_layer->text ? layers[i].text_layer->text : "";
+  }
+  return NULL;
+}
+
+// Dictionaries, serialized as by the firmware: a count, then each tuple as
+// key, type, length and value
+
+#define TUPLE_HEADER_SIZE ((uint32_t)sizeof(Tuple))
+
+uint32_t dict_calc_buffer_size(const uint8_t tuple_count, ...) {
+  uint32_t size = sizeof(Dictionary);
+  va_list args;
+  va_start(args, tuple_count);
+  for (int i = 0; i < tuple_count; i++)
+    size += TUPLE_HEADER_SIZE + va_arg(args, uint32_t);
+  va_end(args);
+  return size;
+}
+
+uint32_t dict_size(DictionaryIterator *iter) {
+  return (const uint8_t *)iter->end - (const uint8_t *)iter->dictionary;
+}
+
+DictionaryResult dict_write_begin(DictionaryIterator *iter, uint8_t *const buffer, const uint16_t size) {
+  if (!iter || !buffer || size < sizeof(Dictionary))
+    return DICT_INVALID_ARGS;
+  iter->dictionary = (Dictionary *)buffer;
+  iter->dictionary->count = 0;
+  iter->cursor = iter->dictionary->head;
+  iter->end = buffer + size;
+  return DICT_OK;
+}
+
+static DictionaryResult dict_write_tuple(DictionaryIterator *iter, uint32_t key, TupleType type,
+                                         const void *data, uint16_t size) {
+  if (!iter || !iter->cursor)
+    return DICT_INVALID_ARGS;
+  uint8_t *at = (uint8_t *)iter->cursor;
+  if (at + TUPLE_HEADER_SIZE + size > (const uint8_t *)iter->end)
+    return DICT_NOT_ENOUGH_STORAGE;
+  Tuple *tuple = iter->cursor;
+  tuple->key = key;
+  tuple->type = type;
+  tuple->length = size;
+  memcpy(tuple->value->data, data, size);
+  iter->cursor = (Tuple *)(at + TUPLE_HEADER_SIZE + size);
+  iter->dictionary->count++;
+  return DICT_OK;
+}
+
+DictionaryResult dict_write_data(DictionaryIterator *iter, const uint32_t key, const uint8_t *const data, const uint16_t size) {
+  return dict_write_tuple(iter, key, TUPLE_BYTE_ARRAY, data, size);
+}
+
+DictionaryResult dict_write_cstring(DictionaryIterator *iter, const uint32_t key, const char *const cstring) {
+  return dict_write_tuple(iter, key, TUPLE_CSTRING, cstring, strlen(cstring) + 1);
+}
+
+DictionaryResult dict_write_int(DictionaryIterator *iter, const uint32_t key, const void *integer, const uint8_t width_bytes, const bool is_signed) {
+  return dict_write_tuple(iter, key, is_signed ? TUPLE_INT : TUPLE_UINT, integer, width_bytes);
+}
+
+DictionaryResult dict_write_uint8(DictionaryIterator *iter, const uint32_t key, const uint8_t value) {
+  return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult dict_write_uint16(DictionaryIterator *iter, const uint32_t key, const uint16_t value) {
+  return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult dict_write_uint32(DictionaryIterator *iter, const uint32_t key, const uint32_t value) {
+  return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult dict_write_int8(DictionaryIterator *iter, const uint32_t key, const int8_t value) {
+  return dict_write_int(iter, key, &value, sizeof(value), true);
+}
+
+DictionaryResult dict_write_int16(DictionaryIterator *iter, const uint32_t key, const int16_t value) {
+  return dict_write_int(iter, key, &value, sizeof(value), true);
+}
+
+DictionaryResult dict_write_int32(DictionaryIterator *iter, const uint32_t key, const int32_t value) {
+  return dict_write_int(iter, key, &value, sizeof(value), true);
+}
+
+uint32_t dict_write_end(DictionaryIterator *iter) {
+  if (!iter || !iter->cursor)
+    return 0;
+  iter->end = iter->cursor;
+  return dict_size(iter);
+}
+
+Tuple *dict_read_begin_from_buffer(DictionaryIterator *iter, const uint8_t *const buffer, const uint16_t size) {
+  if (!iter || !buffer || size < sizeof(Dictionary))
+    return NULL;
+  iter->dictionary = (Dictionary *)buffer;
+  iter->end = buffer + size;
+  return dict_read_first(iter);
+}
+
+Tuple *dict_read_first(DictionaryIterator *iter) {
+  iter->cursor = iter->dictionary->head;
+  return dict_read_next(iter);
+}
+
+// Tuples that would run past the end are not there
+Tuple *dict_read_next(DictionaryIterator *iter) {
+  uint8_t *at = (uint8_t *)iter->cursor;
+  if (at + TUPLE_HEADER_SIZE > (const uint8_t *)iter->end)
+    return NULL;
+  Tuple *tuple = iter->cursor;
+  if (at + TUPLE_HEADER_SIZE + tuple->length > (const uint8_t *)iter->end)
+    return NULL;
+  iter->cursor = (Tuple *)(at + TUPLE_HEADER_SIZE + tuple->length);
+  return tuple;
+}
+
+Tuple *dict_find(const DictionaryIterator *iter, const uint32_t key) {
+  DictionaryIterator reader = *iter;
+  int count = iter->dictionary->count;
+  for (Tuple *tuple = dict_read_first(&reader); tuple && count-- > 0; tuple = dict_read_next(&reader)) {
+    if (tuple->key == key)
+      return tuple;
+  }
+  return NULL;
+}
+
+// App messages. A send goes to the phone model at once and is acked or
+// failed after the latency. Replies queued with sim_deliver() arrive in time
+// order and are dropped when they do not fit the inbox.
+
+AppMessageResult app_message_open(const uint32_t size_inbound, const uint32_t size_outbound) {
+  if (size_inbound > SIM_INBOX_MAX || size_outbound > SIM_OUTBOX_MAX)
+    return APP_MSG_OUT_OF_MEMORY;
+  inbox_size = size_inbound;
+  outbox_size = size_outbound;
+  return APP_MSG_OK;
+}
+
+uint32_t app_message_inbox_size_maximum(void) {
+  return SIM_INBOX_MAX;
+}
+
+uint32_t app_message_outbox_size_maximum(void) {
+  return SIM_OUTBOX_MAX;
+}
+
+AppMessageResult app_message_outbox_begin(DictionaryIterator **iterator) {
+  if (outbox_size == 0) {
+    *iterator = NULL;
+    return APP_MSG_INVALID_ARGS;
+  }
+  if (outbox_in_flight || outbox_open) {
+    *iterator = NULL;
+    return APP_MSG_BUSY;
+  }
+  dict_write_begin(&outbox_iter, outbox_buffer, outbox_size);
+  outbox_open = true;
+  *iterator = &outbox_iter;
+  return APP_MSG_OK;
+}
+
+AppMessageResult app_message_outbox_send(void) {
+  if (!outbox_open)
+    return APP_MSG_INVALID_ARGS;
+  outbox_open = false;
+  if (refused_sends > 0) {
+    refused_sends--;
+    capture_result(TRACE_SEND, APP_MSG_OK);
+    capture_result(TRACE_FAILED, refused_result);
+    return refused_result;
+  }
+
+  dict_write_end(&outbox_iter);
+  capture_result(TRACE_SEND, APP_MSG_OK);
+  sim_counters.messages_sent++;
+  sim_counters.bytes_sent += dict_size(&outbox_iter);
+  if (!bluetooth_connected)
+    outbox_result = APP_MSG_NOT_CONNECTED;
+  else
+    outbox_result = phone ? phone(&outbox_iter) : APP_MSG_OK;
+  outbox_in_flight = true;
+  outbox_due_ms = now_ms + latency_ms;
+  return APP_MSG_OK;
+}
+
+void app_message_deregister_callbacks(void) {
+  inbox_received = NULL;
+  inbox_dropped = NULL;
+  outbox_sent = NULL;
+  outbox_failed = NULL;
+}
+
+AppMessageInboxReceived app_message_register_inbox_received(AppMessageInboxReceived received_callback) {
+  AppMessageInboxReceived old = inbox_received;
+  inbox_received = received_callback;
+  return old;
+}
+
+AppMessageInboxDropped app_message_register_inbox_dropped(AppMessageInboxDropped dropped_callback) {
+  AppMessageInboxDropped old = inbox_dropped;
+  inbox_dropped = dropped_callback;
+  return old;
+}
+
+AppMessageOutboxSent app_message_register_outbox_sent(AppMessageOutboxSent sent_callback) {
+  AppMessageOutboxSent old = outbox_sent;
+  outbox_sent = sent_callback;
+  return old;
+}
+
+AppMessageOutboxFailed app_message_register_outbox_failed(AppMessageOutboxFailed failed_callback) {
+  AppMessageOutboxFailed old = outbox_failed;
+  outbox_failed = failed_callback;
+  return old;
+}
+
+void sim_set_phone(SimPhone model) {
+  phone = model;
+}
+
+void sim_set_inbox_hook(SimInboxHook hook) {
+  inbox_hook = hook;
+}
+
+void sim_refuse_sends(int count, AppMessageResult result) {
+  refused_sends = count;
+  refused_result = result;
+}
+
+void sim_set_latency(uint32_t ms) {
+  latency_ms = ms;
+}
+
+void sim_deliver(const uint8_t *data, uint16_t size, uint32_t delay_ms) {
+  for (int i = 0; i < SIM_PENDING_INBOX; i++) {
+    if (!pending_inbox[i].used) {
+      if (size > sizeof(pending_inbox[i].data))
+        size = sizeof(pending_inbox[i].data);
+      pending_inbox[i].used = true;
+      pending_inbox[i].due_ms = now_ms + delay_ms;
+      pending_inbox[i].order = event_order++;
+      pending_inbox[i].size = size;
+      memcpy(pending_inbox[i].data, data, size);
+      return;
+    }
+  }
+  fprintf(stderr, "sim: inbox queue full, message lost\n");
+}
+
+void sim_drop(AppMessageResult reason) {
+  uint8_t payload[2] = { reason & 0xff, reason >> 8 & 0xff };
+  capture_record(TRACE_DROPPED, payload, sizeof(payload));
+  sim_counters.messages_dropped++;
+  if (inbox_dropped)
+    inbox_dropped(reason, NULL);
+}
+
+static void deliver_inbox(PendingInbox *message) {
+  message->used = false;
+  if (!inbox_received)
+    return;
+  if (!bluetooth_connected || message->size > inbox_size) {
+    sim_drop(bluetooth_connected ? APP_MSG_BUFFER_OVERFLOW : APP_MSG_NOT_CONNECTED);
+    return;
+  }
+  // The face reads the message in place, hand it a copy it cannot outlive
+  static uint8_t buffer[SIM_INBOX_MAX];
+  memcpy(buffer, message->data, message->size);
+  DictionaryIterator iter;
+  dict_read_begin_from_buffer(&iter, buffer, message->size);
+  sim_counters.messages_received++;
+  capture_record(TRACE_RECEIVE, buffer, message->size);
+  if (inbox_hook)
+    inbox_hook(buffer, message->size);
+  no_alloc_in = inbox_handler;
+  inbox_received(&iter, NULL);
+  no_alloc_in = NULL;
+}
+
+static void finish_outbox(void) {
+  outbox_in_flight = false;
+  capture_result(outbox_result == APP_MSG_OK ? TRACE_SENT : TRACE_FAILED, outbox_result);
+  if (outbox_result == APP_MSG_OK) {
+    if (outbox_sent)
+      outbox_sent(&outbox_iter, NULL);
+  } else {
+    sim_counters.messages_failed++;
+    if (outbox_failed)
+      outbox_failed(&outbox_iter, outbox_result, NULL);
+  }
+}
+
+// Timers. Each one is a heap block, freed when it fires or is cancelled, so
+// a handle the face kept past either is not found any more.
+
+static void *heap_alloc(size_t size, bool timer);
+
+static int timer_slot(AppTimer *timer_handle) {
+  for (int i = 0; timer_handle && i < SIM_TIMERS; i++) {
+    if (timers[i] == timer_handle)
+      return i;
+  }
+  return -1;
+}
+
+static void release_timer(int slot) {
+  sim_free(timers[slot]);
+  timers[slot] = NULL;
+}
+
+AppTimer *app_timer_register(uint32_t timeout_ms, AppTimerCallback callback, void *callback_data) {
+  int slot = -1;
+  for (int i = 0; i < SIM_TIMERS && slot < 0; i++) {
+    if (!timers[i])
+      slot = i;
+  }
+  AppTimer *timer = slot >= 0 ? heap_alloc(sizeof(AppTimer), true) : NULL;
+  if (!timer) {
+    fprintf(stderr, "sim: out of timers\n");
+    return NULL;
+  }
+  sim_counters.timers_registered++;
+  *timer = (AppTimer) { now_ms + timeout_ms, event_order++, callback, callback_data };
+  timers[slot] = timer;
+  return timer;
+}
+
+bool app_timer_reschedule(AppTimer *timer_handle, uint32_t new_timeout_ms) {
+  if (timer_slot(timer_handle) < 0)
+    return false;
+  timer_handle->due_ms = now_ms + new_timeout_ms;
+  timer_handle->order = event_order++;
+  return true;
+}
+
+void app_timer_cancel(AppTimer *timer_handle) {
+  int slot = timer_slot(timer_handle);
+  if (slot >= 0)
+    release_timer(slot);
+}
+
+int sim_live_timers(void) {
+  int live = 0;
+  for (int i = 0; i < SIM_TIMERS; i++)
+    live += timers[i] != NULL;
+  return live;
+}
+
+// Services
+
+void tick_timer_service_subscribe(TimeUnits units, TickHandler handler) {
+  tick_units = units;
+  tick_handler = handler;
+}
+
+void tick_timer_service_unsubscribe(void) {
+  tick_handler = NULL;
+}
+
+void bluetooth_connection_service_subscribe(BluetoothConnectionHandler handler) {
+  bluetooth_handler = handler;
+}
+
+void bluetooth_connection_service_unsubscribe(void) {
+  bluetooth_handler = NULL;
+}
+
+bool bluetooth_connection_service_peek(void) {
+  return bluetooth_connected;
+}
+
+void battery_state_service_subscribe(BatteryStateHandler handler) {
+  battery_handler = handler;
+}
+
+void battery_state_service_unsubscribe(void) {
+  battery_handler = NULL;
+}
+
+BatteryChargeState battery_state_service_peek(void) {
+  return battery_state;
+}
+
+void accel_tap_service_subscribe(AccelTapHandler handler) {
+  tap_handler = handler;
+}
+
+void accel_tap_service_unsubscribe(void) {
+  tap_handler = NULL;
+}
+
+bool clock_is_24h_style(void) {
+  return clock_24h;
+}
+
+void vibes_cancel(void) {}
+
+void vibes_short_pulse(void) {
+  sim_counters.vibes++;
+}
+
+void vibes_long_pulse(void) {
+  sim_counters.vibes++;
+}
+
+void vibes_double_pulse(void) {
+  sim_counters.vibes++;
+}
+
+void sim_set_bluetooth(bool connected) {
+  if (connected == bluetooth_connected)
+    return;
+  bluetooth_connected = connected;
+  capture_record(TRACE_BLUETOOTH, &connected, 1);
+  if (bluetooth_handler)
+    bluetooth_handler(connected);
+  render();
+}
+
+void sim_set_battery(uint8_t percent, bool charging) {
+  battery_state = (BatteryChargeState) { percent, charging, charging };
+  if (battery_handler)
+    battery_handler(battery_state);
+  render();
+}
+
+void sim_set_24h(bool clock_24h_style) {
+  clock_24h = clock_24h_style;
+}
+
+void sim_tap(void) {
+  if (tap_handler)
+    tap_handler(ACCEL_AXIS_Z, 1);
+  render();
+}
+
+// Persistent storage, kept across sim_stop() and sim_start() like flash
+
+static PersistEntry *persist_find(uint32_t key) {
+  for (int i = 0; i < SIM_PERSIST_KEYS; i++) {
+    if (persist[i].used && persist[i].key == key)
+      return &persist[i];
+  }
+  return NULL;
+}
+
+static int persist_total(void) {
+  int total = 0;
+  for (int i = 0; i < SIM_PERSIST_KEYS; i++)
+    total += persist[i].used ? persist[i].size : 0;
+  return total;
+}
+
+bool persist_exists(const uint32_t key) {
+  return persist_find(key) != NULL;
+}
+
+int persist_get_size(const uint32_t key) {
+  PersistEntry *entry = persist_find(key);
+  return entry ? entry->size : E_DOES_NOT_EXIST;
+}
+
+bool persist_read_bool(const uint32_t key) {
+  bool value = false;
+  persist_read_data(key, &value, sizeof(value));
+  return value;
+}
+
+int32_t persist_read_int(const uint32_t key) {
+  int32_t value = 0;
+  persist_read_data(key, &value, sizeof(value));
+  return value;
+}
+
+int persist_read_data(const uint32_t key, void *buffer, const size_t buffer_size) {
+  PersistEntry *entry = persist_find(key);
+  if (!entry)
+    return E_DOES_NOT_EXIST;
+  int size = entry->size < buffer_size ? entry->size : (int)buffer_size;
+  memcpy(buffer, entry->data, size);
+  return size;
+}
+
+int persist_write_bool(const uint32_t key, const bool value) {
+  return persist_write_data(key, &value, sizeof(value));
+}
+
+int persist_write_int(const uint32_t key, const int32_t value) {
+  return persist_write_data(key, &value, sizeof(value));
+}
+
+int persist_write_data(const uint32_t key, const void *data, const size_t size) {
+  if (size > PERSIST_DATA_MAX_LENGTH)
+    return E_RANGE;
+  PersistEntry *entry = persist_find(key);
+  int others = persist_total() - (entry ? entry->size : 0);
+  if (others + (int)size > SIM_PERSIST_TOTAL)
+    return E_OUT_OF_STORAGE;
+  for (int i = 0; !entry && i < SIM_PERSIST_KEYS; i++) {
+    if (!persist[i].used)
+      entry = &persist[i];
+  }
+  if (!entry)
+    return E_OUT_OF_STORAGE;
+  sim_counters.persist_writes++;
+  entry->used = true;
+  entry->key = key;
+  entry->size = size;
+  memcpy(entry->data, data, size);
+  return size;
+}
+
+int persist_delete(const uint32_t key) {
+  PersistEntry *entry = persist_find(key);
+  if (!entry)
+    return E_DOES_NOT_EXIST;
+  entry->used = false;
+  return S_SUCCESS;
+}
+
+void sim_clear_persist(void) {
+  memset(persist, 0, sizeof(persist));
+}
+
+// Heap. The face is built with malloc and friends renamed to these, so only
+// its own allocations are counted. Each block carries its size in front.
+
+#define SIM_HEAP_SIZE (24 * 1024)
+#define SIM_BLOCK_HEADER 16
+
+static size_t heap_used;
+
+// A message that changes the calendar, the settings or the link state has
+// the face arm the timers that follow it up. The firmware takes those from
+// the app heap as well, they are counted apart from the face's own blocks.
+static void count_allocation(size_t size, bool timer) {
+  sim_counters.allocations++;
+  if (timer && no_alloc_in == inbox_handler) {
+    sim_counters.inbox_timers++;
+  } else if (no_alloc_in) {
+    sim_counters.hot_allocations++;
+    fprintf(stderr, "sim: %zu byte allocation in %s\n", size, no_alloc_in);
+  }
+}
+
+static size_t block_size(void *ptr) {
+  return ptr ? *(size_t *)((uint8_t *)ptr - SIM_BLOCK_HEADER) : 0;
+}
+
+static void *block_init(uint8_t *block, size_t size) {
+  if (!block)
+    return NULL;
+  *(size_t *)block = size;
+  heap_used += size;
+  return block + SIM_BLOCK_HEADER;
+}
+
+static void *heap_alloc(size_t size, bool timer) {
+  count_allocation(size, timer);
+  if (heap_used + size > SIM_HEAP_SIZE)
+    return NULL;
+  return block_init(malloc(SIM_BLOCK_HEADER + size), size);
+}
+
+void *sim_malloc(size_t size) {
+  return heap_alloc(size, false);
+}
+
+void *sim_calloc(size_t count, size_t size) {
+  void *ptr = sim_malloc(count * size);
+  if (ptr)
+    memset(ptr, 0, count * size);
+  return ptr;
+}
+
+void sim_free(void *ptr) {
+  if (!ptr)
+    return;
+  heap_used -= block_size(ptr);
+  free((uint8_t *)ptr - SIM_BLOCK_HEADER);
+}
+
+void *sim_realloc(void *ptr, size_t size) {
+  void *moved = sim_malloc(size);
+  if (moved && ptr)
+    memcpy(moved, ptr, block_size(ptr) < size ? block_size(ptr) : size);
+  if (moved || size == 0)
+    sim_free(ptr);
+  return moved;
+}
+
+size_t heap_bytes_used(void) {
+  return heap_used;
+}
+
+size_t heap_bytes_free(void) {
+  return SIM_HEAP_SIZE - heap_used;
+}
+
+void app_event_loop(void) {}
+
+// Simulator
+
+void init(void);
+void deinit(void);
+
+void sim_start(time_t now, bool clock_24h_style) {
+  // The face keeps its state in statics, which only a new process clears
+  static bool started;
+  if (started) {
+    fprintf(stderr, "sim: the face was started before in this process, run each start with sim_fork\n");
+    exit(2);
+  }
+  started = true;
+  memset(layers, 0, sizeof(layers));
+  memset(windows, 0, sizeof(windows));
+  memset(bitmaps, 0, sizeof(bitmaps));
+  for (int i = 0; i < SIM_TIMERS; i++)
+    release_timer(i);
+  memset(pending_inbox, 0, sizeof(pending_inbox));
+  app_message_deregister_callbacks();
+  tick_handler = NULL;
+  bluetooth_handler = NULL;
+  battery_handler = NULL;
+  tap_handler = NULL;
+  top_window = NULL;
+  inbox_size = outbox_size = 0;
+  outbox_open = outbox_in_flight = false;
+  refused_sends = 0;
+
+  now_ms = (int64_t)now * 1000;
+  bluetooth_connected = true;
+  battery_state = (BatteryChargeState) { 80, false, false };
+  clock_24h = clock_24h_style;
+  init();
+  render();
+}
+
+void sim_stop(void) {
+  deinit();
+  // The firmware drops the timers of an app that exits
+  for (int i = 0; i < SIM_TIMERS; i++)
+    release_timer(i);
+  for (int i = 0; i < SIM_LAYERS; i++) {
+    if (layers[i].used)
+      fprintf(stderr, "sim: layer %d not destroyed\n", i);
+  }
+  for (int i = 0; i < SIM_BITMAPS; i++) {
+    if (bitmaps[i].used)
+      fprintf(stderr, "sim: bitmap %d not destroyed\n", i);
+  }
+}
+
+void sim_reset_counters(void) {
+  memset(&sim_counters, 0, sizeof(sim_counters));
+}
+
+static bool read_all(int fd, void *data, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t n = read(fd, (uint8_t *)data + done, size - done);
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t n = write(fd, (const uint8_t *)data + done, size - done);
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+// The child hands back the flash and the counters it ended with, so the
+// next run starts warm and the counts carry on as in one process
+bool sim_fork(SimScenario scenario, void *data) {
+  int pipe_fd[2];
+  fflush(NULL);
+  if (pipe(pipe_fd) != 0)
+    return false;
+  pid_t child = fork();
+  if (child < 0) {
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    return false;
+  }
+  if (child == 0) {
+    close(pipe_fd[0]);
+    scenario(data);
+    fflush(NULL);
+    bool written = write_all(pipe_fd[1], persist, sizeof(persist)) &&
+                   write_all(pipe_fd[1], &sim_counters, sizeof(sim_counters));
+    _exit(written ? 0 : 1);
+  }
+
+  close(pipe_fd[1]);
+  static PersistEntry flash[SIM_PERSIST_KEYS];
+  SimCounters counters;
+  bool read = read_all(pipe_fd[0], flash, sizeof(flash)) && read_all(pipe_fd[0], &counters, sizeof(counters));
+  close(pipe_fd[0]);
+  int status;
+  if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !read) {
+    fprintf(stderr, "sim: a forked run did not finish\n");
+    return false;
+  }
+  memcpy(persist, flash, sizeof(persist));
+  sim_counters = counters;
+  return true;
+}
+
+// Hand out everything due up to now_ms + ms in time order, with ties going
+// to whatever was queued first
+void sim_run(int64_t ms) {
+  int64_t end = now_ms + ms;
+  for (;;) {
+    int64_t next = end + 1;
+    uint32_t order = UINT32_MAX;
+    PendingInbox *message = NULL;
+
+    int slot = -1;
+    for (int i = 0; i < SIM_TIMERS; i++) {
+      if (timers[i] && (timers[i]->due_ms < next || (timers[i]->due_ms == next && timers[i]->order < order))) {
+        next = timers[i]->due_ms;
+        order = timers[i]->order;
+        slot = i;
+      }
+    }
+    for (int i = 0; i < SIM_PENDING_INBOX; i++) {
+      if (pending_inbox[i].used && (pending_inbox[i].due_ms < next ||
+          (pending_inbox[i].due_ms == next && pending_inbox[i].order < order))) {
+        next = pending_inbox[i].due_ms;
+        order = pending_inbox[i].order;
+        message = &pending_inbox[i];
+        slot = -1;
+      }
+    }
+    bool ack = outbox_in_flight && outbox_due_ms <= next;
+    if (ack)
+      next = outbox_due_ms;
+    int64_t minute = (now_ms / 60000 + 1) * 60000;
+    bool tick = tick_handler && (tick_units & MINUTE_UNIT) && minute < next;
+    if (tick)
+      next = minute;
+    if (next > end)
+      break;
+
+    now_ms = next;
+    if (tick) {
+      time_t seconds = now_ms / 1000;
+      struct tm tick_time = *localtime(&seconds);
+      uint8_t tick[4] = { seconds & 0xff, seconds >> 8 & 0xff, seconds >> 16 & 0xff, seconds >> 24 & 0xff };
+      capture_record(TRACE_TICK, tick, sizeof(tick));
+      tick_handler(&tick_time, MINUTE_UNIT);
+    } else if (ack) {
+      finish_outbox();
+    } else if (message) {
+      deliver_inbox(message);
+    } else {
+      AppTimer fired = *timers[slot];
+      release_timer(slot);
+      fired.callback(fired.data);
+    }
+    render();
+  }
+  now_ms = end;
+  render();
+}
@@ -0,0 +1,174 @@
+#include "phone.h"
+#include "common.h"
+
+static PhoneEvent calendar[PHONE_MAX_EVENTS];
+static int calendar_count;
+static uint32_t calendar_version = 1;
+
+static int8_t battery_level = 90;
+static bool battery_charging;
+static int8_t battery_sent = -1;
+static uint8_t battery_step;
+
+static uint16_t watch_inbox_bytes;
+
+void phone_set_calendar(const PhoneEvent *events, int count) {
+  calendar_count = count < PHONE_MAX_EVENTS ? count : PHONE_MAX_EVENTS;
+  memcpy(calendar, events, calendar_count * sizeof(PhoneEvent));
+  calendar_version++;
+}
+
+static void pad(char *out, const char *text, int len) {
+  int n = snprintf(out, PHONE_TEXT_MAX, "%s", text);
+  while (n < len && n < PHONE_TEXT_MAX - 1)
+    out[n] = 'a' + n % 26, n++;
+  out[n] = '\0';
+}
+
+void phone_make_calendar(time_t now, int count, int title_len, int location_len) {
+  PhoneEvent events[PHONE_MAX_EVENTS];
+  if (count > PHONE_MAX_EVENTS)
+    count = PHONE_MAX_EVENTS;
+  for (int i = 0; i < count; i++) {
+    char text[16];
+    events[i] = (PhoneEvent) {
+      // One every five hours from the next full hour, every fourth all day
+      .start = (now / 3600 + 1 + 5 * i) * 3600,
+      .alarms = { -15, 0 },
+      .all_day = i % 4 == 3
+    };
+    if (events[i].all_day)
+      events[i].start -= events[i].start % DAY_SECONDS;
+    snprintf(text, sizeof(text), "Event %d ", i);
+    pad(events[i].title, text, title_len);
+    snprintf(text, sizeof(text), "Room %d ", i);
+    pad(events[i].location, text, location_len);
+  }
+  phone_set_calendar(events, count);
+}
+
+void phone_edit_calendar(int i) {
+  if (i >= calendar_count)
+    return;
+  calendar[i].start += 3600;
+  calendar_version++;
+}
+
+void phone_touch_calendar(void) {
+  calendar_version++;
+}
+
+uint32_t phone_calendar_version(void) {
+  return calendar_version;
+}
+
+int phone_event_count(void) {
+  return calendar_count;
+}
+
+const PhoneEvent *phone_event(int i) {
+  return &calendar[i];
+}
+
+static void put_le(uint8_t *out, uint32_t value, int size) {
+  for (int i = 0; i < size; i++)
+    out[i] = value >> (8 * i);
+}
+
+static int encode_event(uint8_t *out, int i) {
+  const PhoneEvent *e = &calendar[i];
+  uint8_t title_len = strlen(e->title);
+  uint8_t location_len = strlen(e->location);
+  out[0] = i;
+  out[1] = e->all_day ? EVENT_V2_ALL_DAY : 0;
+  put_le(&out[2], e->start, 4);
+  put_le(&out[6], (uint16_t)e->alarms[0], 2);
+  put_le(&out[8], (uint16_t)e->alarms[1], 2);
+  int pos = EVENT_V2_HEADER_SIZE;
+  out[pos++] = title_len;
+  memcpy(&out[pos], e->title, title_len);
+  pos += title_len;
+  out[pos++] = location_len;
+  memcpy(&out[pos], e->location, location_len);
+  return pos + location_len;
+}
+
+// Send the events from index on, as many as fit in one watch message
+static void send_calendar(int index) {
+  static uint8_t records[2048];
+  int size = 1;
+  int count = 0;
+  records[0] = 0;
+  for (int i = index; i < calendar_count; i++) {
+    uint8_t record[EVENT_V2_HEADER_SIZE + 2 * PHONE_TEXT_MAX];
+    int n = encode_event(record, i);
+    if (count > 0 && size + n > watch_inbox_bytes)
+      break;
+    memcpy(&records[size], record, n);
+    size += n;
+    count++;
+  }
+  records[0] = count;
+
+  uint8_t buffer[2048 + 64];
+  DictionaryIterator iter;
+  dict_write_begin(&iter, buffer, sizeof(buffer));
+  dict_write_uint8(&iter, CALENDAR_BATCH_KEY, calendar_count);
+  dict_write_uint32(&iter, CALENDAR_VERSION_KEY, calendar_version);
+  if (count > 0)
+    dict_write_data(&iter, CALENDAR_RESPONSE_V2_KEY, records, size);
+  sim_deliver(buffer, dict_write_end(&iter), 150);
+}
+
+void phone_push_calendar(void) {
+  send_calendar(0);
+}
+
+static void send_battery(void) {
+  uint8_t buffer[32];
+  uint8_t status[2] = { battery_charging ? 2 : 1, (uint8_t)battery_level };
+  DictionaryIterator iter;
+  dict_write_begin(&iter, buffer, sizeof(buffer));
+  dict_write_data(&iter, BATTERY_RESPONSE_KEY, status, sizeof(status));
+  sim_deliver(buffer, dict_write_end(&iter), 150);
+  battery_sent = battery_level;
+}
+
+void phone_set_battery(int8_t level, bool charging) {
+  bool moved = battery_step && (level - battery_sent >= battery_step || battery_sent - level >= battery_step);
+  bool state_changed = charging != battery_charging;
+  battery_level = level;
+  battery_charging = charging;
+  if (battery_sent >= 0 && (moved || state_changed))
+    send_battery();
+}
+
+AppMessageResult phone_handle(DictionaryIterator *request) {
+  Tuple *tuple = dict_find(request, CALENDAR_INBOX_KEY);
+  if (tuple)
+    watch_inbox_bytes = tuple->value->uint16;
+
+  tuple = dict_find(request, REQUEST_CALENDAR_KEY);
+  if (tuple) {
+    Tuple *version = dict_find(request, CALENDAR_VERSION_KEY);
+    int index = tuple->value->int8;
+    if (index == 0 && version && version->value->uint32 == calendar_version) {
+      // Nothing changed, say so with the version alone
+      uint8_t buffer[32];
+      DictionaryIterator iter;
+      dict_write_begin(&iter, buffer, sizeof(buffer));
+      dict_write_uint32(&iter, CALENDAR_VERSION_KEY, calendar_version);
+      sim_deliver(buffer, dict_write_end(&iter), 150);
+    } else {
+      send_calendar(index);
+    }
+  }
+
+  tuple = dict_find(request, REQUEST_BATTERY_KEY);
+  if (tuple) {
+    Tuple *step = dict_find(request, BATTERY_STEP_KEY);
+    battery_step = step ? step->value->uint8 : 0;
+    send_battery();
+  }
+  return APP_MSG_OK;
+}
@@ -0,0 +1,42 @@
+#ifndef phone_h
+#define phone_h
+
+#include "sim.h"
+
+// Model of the phone app for the simulator. It answers calendar requests
+// with v2 records, packed into as many messages as the watch inbox needs and
+// skipped when the watch already holds the current version, and it pushes
+// the phone battery when it moves by the step the watch asked for.
+
+#define PHONE_MAX_EVENTS 32
+#define PHONE_TEXT_MAX 96
+
+typedef struct {
+  time_t start;
+  int16_t alarms[2];
+  bool all_day;
+  char title[PHONE_TEXT_MAX];
+  char location[PHONE_TEXT_MAX];
+} PhoneEvent;
+
+// Replace the calendar, bumping its version
+void phone_set_calendar(const PhoneEvent *events, int count);
+// A calendar of count events from now on, with titles and locations padded
+// to the given lengths
+void phone_make_calendar(time_t now, int count, int title_len, int location_len);
+// Move one event an hour later, as an edit on the phone would
+void phone_edit_calendar(int i);
+// Resend the calendar as is, with a new version
+void phone_touch_calendar(void);
+void phone_set_battery(int8_t level, bool charging);
+// Send the calendar without being asked, as after a change on the phone
+void phone_push_calendar(void);
+
+uint32_t phone_calendar_version(void);
+int phone_event_count(void);
+const PhoneEvent *phone_event(int i);
+
+// SimPhone for sim_set_phone()
+AppMessageResult phone_handle(DictionaryIterator *request);
+
+#endif
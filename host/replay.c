@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include "sim.h"
+#include "trace.h"
+
+// Feeds a trace back through the face. Messages arrive or are dropped,
+// Bluetooth comes and goes and sends succeed or fail as recorded, while the
+// face's own timers and minute ticks run on the virtual clock in between.
+// Prints what the face did next to what the trace says it did, and fails
+// when the number of sends differs.
+//
+//   replay trace [24h]
+//
+// The trace is either a watch dump, the TRACE_RESPONSE_KEY chunks joined, or
+// a capture from host/sim. Records before the first TRACE_CLOCK are skipped.
+
+typedef struct {
+  uint8_t type;
+  int64_t at_ms;
+  uint16_t length;
+  const uint8_t *data;
+  // For a TRACE_SEND, the record with its result or -1, and whether the
+  // firmware refused it outright
+  int result;
+  bool refused;
+} Record;
+
+static Record *records;
+static int record_count;
+// Next send to take the result of
+static int send_pos;
+
+static uint8_t *read_file(const char *path, long *size) {
+  FILE *in = fopen(path, "rb");
+  if (!in)
+    return NULL;
+  fseek(in, 0, SEEK_END);
+  *size = ftell(in);
+  rewind(in);
+  uint8_t *data = malloc(*size ? *size : 1);
+  if (fread(data, 1, *size, in) != (size_t)*size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(in);
+  return data;
+}
+
+// Split the trace into records with absolute times, false when it is cut short
+static bool parse(const uint8_t *data, long size) {
+  int64_t at_ms = -1;
+  long pos = 0;
+  records = malloc((size / TRACE_HEADER_SIZE + 1) * sizeof(Record));
+  while (pos + TRACE_HEADER_SIZE <= size) {
+    const uint8_t *header = &data[pos];
+    uint16_t delta = header[1] | header[2] << 8;
+    uint16_t length = header[3] | header[4] << 8;
+    const uint8_t *payload = &data[pos + TRACE_HEADER_SIZE];
+    pos += TRACE_HEADER_SIZE + length;
+    if (pos > size)
+      return false;
+
+    if (header[0] == TRACE_CLOCK && length >= 6) {
+      uint32_t seconds = payload[0] | payload[1] << 8 | payload[2] << 16 | (uint32_t)payload[3] << 24;
+      at_ms = (int64_t)seconds * 1000 + (payload[4] | payload[5] << 8);
+      continue;
+    }
+    if (at_ms < 0)
+      continue;
+    at_ms += delta;
+    records[record_count++] = (Record) { header[0], at_ms, length, payload, -1, false };
+  }
+  return pos == size;
+}
+
+// Pair each send with its result, only one message is ever in flight
+static void pair_results(void) {
+  int send = -1;
+  for (int i = 0; i < record_count; i++) {
+    Record *r = &records[i];
+    if (r->type == TRACE_SEND) {
+      send = i;
+    } else if ((r->type == TRACE_SENT || r->type == TRACE_FAILED) && send >= 0) {
+      records[send].result = i;
+      records[send].refused = r->type == TRACE_FAILED && r->at_ms == records[send].at_ms;
+      send = -1;
+    }
+  }
+}
+
+static AppMessageResult failure(const Record *r) {
+  return r->length >= 3 ? r->data[1] | r->data[2] << 8 : APP_MSG_SEND_TIMEOUT;
+}
+
+// Answer each send the face makes with the next recorded result, acked as
+// long after the send as it was on the watch. Refused sends never get here.
+static AppMessageResult recorded_result(DictionaryIterator *request) {
+  for (; send_pos < record_count; send_pos++) {
+    Record *r = &records[send_pos];
+    if (r->type != TRACE_SEND || r->refused)
+      continue;
+    send_pos++;
+    if (r->result < 0)
+      break;
+    Record *result = &records[r->result];
+    sim_set_latency(result->at_ms > sim_now_ms() ? result->at_ms - sim_now_ms() : 0);
+    return result->type == TRACE_FAILED ? failure(result) : APP_MSG_OK;
+  }
+  sim_set_latency(100);
+  return APP_MSG_OK;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: replay trace [24h]\n");
+    return 2;
+  }
+  long size;
+  uint8_t *data = read_file(argv[1], &size);
+  if (!data) {
+    fprintf(stderr, "replay: cannot read %s\n", argv[1]);
+    return 2;
+  }
+  if (!parse(data, size))
+    fprintf(stderr, "replay: %s ends inside a record, replaying what is whole\n", argv[1]);
+  pair_results();
+  if (record_count == 0) {
+    fprintf(stderr, "replay: no records after a clock in %s\n", argv[1]);
+    return 2;
+  }
+
+  setenv("TZ", "UTC", 1);
+  tzset();
+  sim_set_phone(recorded_result);
+  sim_start(records[0].at_ms / 1000, argc > 2 && strcmp(argv[2], "24h") == 0);
+  sim_run(records[0].at_ms % 1000);
+
+  uint32_t sends = 0, refused = 0, receives = 0, drops = 0, skipped = 0;
+  for (int i = 0; i < record_count; i++) {
+    Record *r = &records[i];
+    // The face sends as the clock reaches the record, have it refused then
+    if (r->type == TRACE_SEND && r->refused)
+      sim_refuse_sends(1, failure(&records[r->result]));
+    if (r->at_ms > sim_now_ms())
+      sim_run(r->at_ms - sim_now_ms());
+    switch (r->type) {
+      case TRACE_RECEIVE:
+        // The watch keeps no payload for dictionaries over TRACE_RECORD_MAX
+        if (r->length == 0) {
+          skipped++;
+          break;
+        }
+        receives++;
+        sim_deliver(r->data, r->length, 0);
+        sim_run(0);
+        break;
+      case TRACE_DROPPED:
+        drops++;
+        sim_drop(r->length >= 2 ? r->data[0] | r->data[1] << 8 : APP_MSG_BUFFER_OVERFLOW);
+        break;
+      case TRACE_BLUETOOTH:
+        if (r->length >= 1)
+          sim_set_bluetooth(r->data[0]);
+        break;
+      case TRACE_SEND:
+        if (r->refused)
+          refused++;
+        else
+          sends++;
+        break;
+    }
+  }
+
+  printf("replayed %.1f hours, %d records\n", (records[record_count - 1].at_ms - records[0].at_ms) / 3600000.0,
+         record_count);
+  printf("messages: %u sent (trace %u, %u more refused), %u failed, %u received (trace %u, %u without payload), "
+         "%u dropped (trace %u)\n", sim_counters.messages_sent, sends, refused, sim_counters.messages_failed,
+         sim_counters.messages_received, receives, skipped, sim_counters.messages_dropped, drops);
+  printf("redraws: %u frames, %u layer draws\n", sim_counters.redraws, sim_counters.layer_draws);
+  printf("vibes: %u\n", sim_counters.vibes);
+  sim_stop();
+  free(records);
+  free(data);
+  return sim_counters.messages_sent != sends;
+}
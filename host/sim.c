@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include "phone.h"
+
+// A simulated week of normal use: a calendar of a dozen events edited on the
+// phone a few times a day, a phone battery draining and charging, a Bluetooth
+// drop each evening and a flaky hour where the firmware refuses sends. Prints
+// what the face cost the watch, per day and for the week. With a file name,
+// everything that drove the face is captured there for host/replay.
+//
+//   sim [days] [12h|24h] [trace]
+
+#define SIM_EPOCH 1717977600 // Monday 10 June 2024, midnight UTC
+
+static void print_counters(const char *label) {
+  printf("%-6s %6u sent %4u failed %7u bytes %5u received %3u dropped "
+         "%5u timers %6u redraws %7u draws %3u vibes %4u writes %3u allocs\n",
+         label, sim_counters.messages_sent, sim_counters.messages_failed, sim_counters.bytes_sent,
+         sim_counters.messages_received, sim_counters.messages_dropped, sim_counters.timers_registered,
+         sim_counters.redraws, sim_counters.layer_draws, sim_counters.vibes, sim_counters.persist_writes, sim_counters.allocations);
+}
+
+static void add_counters(SimCounters *total) {
+  uint32_t *sum = (uint32_t *)total;
+  const uint32_t *day = (const uint32_t *)&sim_counters;
+  for (size_t i = 0; i < sizeof(SimCounters) / sizeof(uint32_t); i++)
+    sum[i] += day[i];
+}
+
+#ifdef PROFILE
+#define PROFILE_EXTERN
+#include "profile.h"
+
+// The face's own histograms, see src/profile.h. Time stands still inside a
+// call on the virtual clock, so here they count calls and heap growth.
+static void print_profile(void) {
+  for (int i = 0; i < PROFILE_SLOTS; i++) {
+    uint32_t calls = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++)
+      calls += profile[i].buckets[b];
+    printf("profile %-8s %7u calls, heap grew %u\n", profile_names[i], calls, profile[i].heap_grew);
+  }
+}
+#endif
+
+static void run_day(int day) {
+  // Morning: wake the phone battery and the calendar up
+  sim_run(7 * 60 * 60 * 1000);
+  phone_set_battery(100 - 5 * day, false);
+  for (int hour = 8; hour < 18; hour++) {
+    if (hour % 3 == 0)
+      phone_edit_calendar(hour % phone_event_count());
+    if (hour == 11)
+      phone_push_calendar();
+    // An hour where the firmware refuses every other send
+    if (hour == 14 && day % 2 == 1)
+      sim_refuse_sends(3, APP_MSG_BUSY);
+    phone_set_battery(95 - 5 * day - 4 * (hour - 8), false);
+    sim_tap();
+    sim_run(60 * 60 * 1000);
+  }
+  // Evening: the phone leaves the room for twenty minutes, then charges
+  sim_run(2 * 60 * 60 * 1000);
+  sim_set_bluetooth(false);
+  sim_run(20 * 60 * 1000);
+  sim_set_bluetooth(true);
+  phone_set_battery(40, true);
+  sim_run(4 * 60 * 60 * 1000 + 40 * 60 * 1000);
+}
+
+int main(int argc, char **argv) {
+  int days = argc > 1 ? atoi(argv[1]) : 7;
+  bool clock_24h = argc > 2 && strcmp(argv[2], "24h") == 0;
+  FILE *trace = NULL;
+  if (argc > 3 && !(trace = fopen(argv[3], "wb"))) {
+    fprintf(stderr, "sim: cannot write %s\n", argv[3]);
+    return 2;
+  }
+
+  setenv("TZ", "UTC", 1);
+  tzset();
+  phone_make_calendar(SIM_EPOCH, 12, 24, 12);
+  sim_set_phone(phone_handle);
+  sim_capture(trace);
+  sim_start(SIM_EPOCH, clock_24h);
+
+  SimCounters total = { 0 };
+  for (int day = 0; day < days; day++) {
+    char label[16];
+    sim_reset_counters();
+    run_day(day);
+    snprintf(label, sizeof(label), "day %d", day + 1);
+    print_counters(label);
+    add_counters(&total);
+  }
+  sim_counters = total;
+  print_counters("total");
+#ifdef PROFILE
+  print_profile();
+#endif
+  sim_stop();
+  if (trace)
+    fclose(trace);
+  return 0;
+}
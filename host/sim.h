@@ -0,0 +1,87 @@
+#ifndef sim_h
+#define sim_h
+
+#include "pebble.h"
+
+// Time-accelerated simulator for the face, built on the stub SDK in pebble.c.
+// Virtual time only moves in sim_run(), which hands out timers, minute ticks,
+// message acks and phone replies in time order and renders a frame after each
+// one that dirtied a layer. The counters say what the face cost the watch.
+
+typedef struct {
+  uint32_t messages_sent;
+  uint32_t messages_failed;
+  uint32_t bytes_sent;
+  uint32_t messages_received;
+  uint32_t messages_dropped;
+  uint32_t timers_registered;
+  uint32_t redraws;
+  uint32_t layer_draws;
+  uint32_t vibes;
+  uint32_t persist_writes;
+  uint32_t allocations;
+  // Allocations inside a layer update proc or the inbox handler
+  uint32_t hot_allocations;
+  // Timers armed inside the inbox handler, heap blocks as well but expected
+  uint32_t inbox_timers;
+} SimCounters;
+
+extern SimCounters sim_counters;
+
+// Called for every message the face sends, with the message as the phone
+// gets it. Return APP_MSG_OK to have it acknowledged, anything else fails it.
+typedef AppMessageResult (*SimPhone)(DictionaryIterator *request);
+
+// Called with every dictionary the face receives, before the face sees it
+typedef void (*SimInboxHook)(const uint8_t *data, uint16_t size);
+
+// Start the watch at the given time with the firmware defaults: Bluetooth up,
+// the watch battery at 80% and nothing in persistent storage unless kept.
+// The face's statics are never cleared, so a process starts it only once.
+void sim_start(time_t now, bool clock_24h);
+void sim_stop(void);
+
+// Run a scenario, sim_start to sim_stop, in a child process, as the watch
+// runs each launch of the face afresh. Persistent storage and the counters
+// come back from the child. False when the child did not finish.
+typedef void (*SimScenario)(void *data);
+bool sim_fork(SimScenario scenario, void *data);
+// Forget what the face left in persistent storage
+void sim_clear_persist(void);
+void sim_reset_counters(void);
+
+void sim_run(int64_t ms);
+time_t sim_now(void);
+int64_t sim_now_ms(void);
+
+void sim_set_phone(SimPhone phone);
+void sim_set_inbox_hook(SimInboxHook hook);
+// Fail the next sends synchronously with result, as a busy firmware does
+void sim_refuse_sends(int count, AppMessageResult result);
+// Latency between a send and its ack, and between a reply and its delivery
+void sim_set_latency(uint32_t ms);
+
+// Queue a serialized dictionary for delivery after delay_ms
+void sim_deliver(const uint8_t *data, uint16_t size, uint32_t delay_ms);
+// Have the firmware drop an incoming message for reason, now
+void sim_drop(AppMessageResult reason);
+
+// Write what drives the face to out as the records of src/trace.h, for
+// host/replay to feed back later. NULL stops.
+void sim_capture(FILE *out);
+
+void sim_set_bluetooth(bool connected);
+void sim_set_battery(uint8_t percent, bool charging);
+void sim_set_24h(bool clock_24h);
+void sim_tap(void);
+void sim_set_log(bool enabled);
+
+// The face's allocator, malloc and free are renamed to these when it is built
+void *sim_malloc(size_t size);
+void sim_free(void *ptr);
+
+// Text of the layer at the given frame origin, NULL when there is none
+const char *sim_text_at(int16_t x, int16_t y);
+int sim_live_timers(void);
+
+#endif
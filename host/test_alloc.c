@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include "phone.h"
+
+// Once init() is done, the face must not touch the heap while drawing or
+// handling a message. Two days of calendar transfers, edits, battery pushes,
+// Bluetooth drops and agenda taps in both clock styles must not allocate in
+// a layer update proc or the inbox handler. Timers are heap blocks too, the
+// ones a message has the face arm are allowed and reported. A layer that does
+// allocate checks that the counting catches it. Each run is a launch of its
+// own, the second one starting from the flash the first left.
+
+#define TEST_EPOCH 1717977600
+
+static void allocate_while_drawing(Layer *layer, GContext *ctx) {
+  sim_free(sim_malloc(16));
+}
+
+static void run(void *data) {
+  bool clock_24h = *(bool *)data;
+  phone_make_calendar(TEST_EPOCH, 20, 30, 15);
+  sim_start(TEST_EPOCH, clock_24h);
+  for (int hour = 0; hour < 48; hour++) {
+    if (hour % 5 == 0)
+      phone_edit_calendar(hour % phone_event_count());
+    if (hour % 7 == 0)
+      phone_push_calendar();
+    if (hour % 12 == 6)
+      phone_make_calendar(sim_now(), 5 + hour % 15, 60, 40);
+    phone_set_battery(100 - hour * 2, hour % 24 > 20);
+    if (hour % 24 == 20)
+      sim_set_bluetooth(false);
+    if (hour % 24 == 21)
+      sim_set_bluetooth(true);
+    sim_tap();
+    sim_run(60 * 60 * 1000);
+  }
+  sim_stop();
+}
+
+static void run_canary(void *data) {
+  sim_start(TEST_EPOCH, false);
+  Layer *canary = layer_create(GRect(0, 0, 1, 1));
+  layer_set_update_proc(canary, allocate_while_drawing);
+  layer_add_child(window_get_root_layer(window_stack_get_top_window()), canary);
+  layer_mark_dirty(canary);
+  sim_run(0);
+  layer_destroy(canary);
+  sim_stop();
+}
+
+int main(void) {
+  setenv("TZ", "UTC", 1);
+  tzset();
+  sim_set_phone(phone_handle);
+  bool clock_24h[] = { false, true };
+  for (int i = 0; i < 2; i++) {
+    if (!sim_fork(run, &clock_24h[i]))
+      return 2;
+  }
+  uint32_t face = sim_counters.hot_allocations;
+
+  if (!sim_fork(run_canary, NULL))
+    return 2;
+  bool caught = sim_counters.hot_allocations > face;
+
+  printf("alloc: %u allocations by the face, %u while drawing or receiving, %u timers armed by messages%s\n",
+         sim_counters.allocations - (caught ? 1 : 0), face, sim_counters.inbox_timers,
+         caught ? "" : ", the canary went unseen");
+  return face != 0 || !caught;
+}
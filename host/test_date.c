@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include "common.h"
+
+// Every day of two 400-year cycles, one on each side of the epoch, against
+// gmtime and strftime. The Gregorian calendar repeats every 400 years, so
+// that is every case the date math has.
+
+#define FIRST_YEAR 1600
+#define LAST_YEAR 2399
+
+static int failures;
+
+// The other half of H. Hinnant's pair, and a second ISO week path to hold
+// iso_week_from_tm against besides strftime
+static void civil_from_days(int32_t z, int *y, int *m, int *d) {
+  z += 719468;
+  int32_t era = (z >= 0 ? z : z - 146096) / 146097;
+  int32_t doe = z - era * 146097;
+  int32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  int32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  int32_t mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp < 10 ? mp + 3 : mp - 9;
+  *y = yoe + era * 400 + (*m <= 2);
+}
+
+// The week of the Thursday of the week, by day numbers alone
+static int iso_week_from_days(int32_t z) {
+  int32_t thursday = z - (weekday_from_days(z) + 6) % 7 + 3;
+  int y, m, d;
+  civil_from_days(thursday, &y, &m, &d);
+  return (thursday - days_from_civil(y, 1, 1)) / 7 + 1;
+}
+
+static void fail(const struct tm *t, const char *what, int got, int want) {
+  if (failures++ < 10)
+    fprintf(stderr, "%04d-%02d-%02d: %s %d, want %d\n",
+            t->tm_year + 1900, t->tm_mon + 1, t->tm_mday, what, got, want);
+}
+
+int main(void) {
+  int32_t first = days_from_civil(FIRST_YEAR, 1, 1);
+  int32_t last = days_from_civil(LAST_YEAR, 12, 31);
+
+  for (int32_t z = first; z <= last; z++) {
+    time_t seconds = (time_t)z * DAY_SECONDS;
+    struct tm t = *gmtime(&seconds);
+    char week[4];
+    strftime(week, sizeof(week), "%V", &t);
+
+    int y, m, d;
+    civil_from_days(z, &y, &m, &d);
+    if (y != t.tm_year + 1900 || m != t.tm_mon + 1 || d != t.tm_mday)
+      fail(&t, "civil_from_days day", d, t.tm_mday);
+    if (days_from_civil(t.tm_year + 1900, t.tm_mon + 1, t.tm_mday) != z)
+      fail(&t, "days_from_civil", days_from_civil(t.tm_year + 1900, t.tm_mon + 1, t.tm_mday), z);
+    if (days_from_tm(&t) != z)
+      fail(&t, "days_from_tm", days_from_tm(&t), z);
+    if (weekday_from_days(z) != t.tm_wday)
+      fail(&t, "weekday_from_days", weekday_from_days(z), t.tm_wday);
+    if (iso_week_from_days(z) != atoi(week))
+      fail(&t, "iso_week_from_days", iso_week_from_days(z), atoi(week));
+    if (iso_week_from_tm(&t) != atoi(week))
+      fail(&t, "iso_week_from_tm", iso_week_from_tm(&t), atoi(week));
+  }
+
+  printf("date: %d days from %d to %d, %d failures\n", last - first + 1, FIRST_YEAR, LAST_YEAR, failures);
+  return failures != 0;
+}
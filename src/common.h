@@ -22,10 +22,12 @@
  * THE SOFTWARE.
  */
 
-//#ifndef common_h
-//#define common_h
+#ifndef common_h
+#define common_h
 
 #include "pebble.h"
+// Name and week tables, generated by tools/tables.py
+#include "tables.auto.h"
 
 //#define INVERSE
 
@@ -37,6 +39,19 @@
 #define BATTERY_RESPONSE_KEY 9
 #define REQUEST_SETTINGS_KEY 27
 #define SETTINGS_RESPONSE_KEY 28
+#define CALENDAR_BATCH_KEY 40
+#define CALENDAR_VERSION_KEY 41
+#define CALENDAR_BASE_KEY 42
+#define BATTERY_STEP_KEY 43
+#define CALENDAR_RESPONSE_V2_KEY 44
+#define CALENDAR_FORMAT_KEY 45
+#define CALENDAR_INBOX_KEY 46
+#define REQUEST_DIAGNOSTICS_KEY 47
+#define DIAGNOSTICS_RESPONSE_KEY 48
+#define REQUEST_TRACE_KEY 49
+#define TRACE_RESPONSE_KEY 50
+#define TRACE_OFFSET_KEY 51
+#define TRACE_TOTAL_KEY 52
 
 //#define SETTINGS_KEY_INVERSE 200
 //#define SETTINGS_KEY_ANIMATE 201
@@ -47,28 +62,131 @@
 #define CLOCK_STYLE_12H 1
 #define CLOCK_STYLE_24H 2
 
-#define MAX_EVENTS 15
+#define MAX_EVENTS 20
+#define MAX_ALARMS (MAX_EVENTS * 3)
+
+// Requests waiting in the outbox queue, in the order they are sent
+#define OUTBOX_CALENDAR 0x01
+#define OUTBOX_BATTERY 0x02
+#define OUTBOX_DIAGNOSTICS 0x04
+#define OUTBOX_TRACE 0x08
+#define OUTBOX_RETRY_MIN_MS 1000
+#define OUTBOX_RETRY_MAX_MS (5 * 60 * 1000)
 #define ROT_MAX 5
 
+// Buffer size of a dictionary as dict_calc_buffer_size() gives it: a count,
+// then a key, type and length in front of each value
+#define DICT_SIZE(tuples, value_bytes) (1 + (tuples) * 7 + (value_bytes))
+// The outbox holds the largest request whole, the calendar request with its
+// six scalars or the diagnostics reply
+#define OUTBOX_CALENDAR_SIZE DICT_SIZE(6, 1 + 1 + 1 + 4 + 1 + 2)
+#define OUTBOX_DIAGNOSTICS_SIZE DICT_SIZE(1, sizeof(Diagnostics))
+#define OUTBOX_SIZE (OUTBOX_CALENDAR_SIZE > OUTBOX_DIAGNOSTICS_SIZE ? OUTBOX_CALENDAR_SIZE : OUTBOX_DIAGNOSTICS_SIZE)
+
+// Display settings
+#define SETTINGS_KEY_INVERT 100
+#define SETTINGS_KEY_DAY_NAME 106
+#define SETTINGS_KEY_MONTH_NAME 107
+#define SETTINGS_KEY_WEEK_NO 108
+
+// Phone battery is pushed when the level moves this many percent or the state changes
+#define SETTINGS_KEY_BATTERY_STEP 101
+#define BATTERY_STEP_DEFAULT 10
+
+// Power governor, quiet hours run from start up to end hour, equal hours turn them off
+#define SETTINGS_KEY_QUIET_START 102
+#define SETTINGS_KEY_QUIET_END 103
+#define SETTINGS_KEY_LOW_BATTERY 104
+#define QUIET_START_DEFAULT 0
+#define QUIET_END_DEFAULT 6
+#define LOW_BATTERY_DEFAULT 20
+#define POWER_NORMAL 0
+#define POWER_RELAXED 1
+#define POWER_LOW_BATTERY 2
+#define POWER_QUIET 3
+#define POWER_NORMAL_AHEAD (2 * 60 * 60)
+
+// Connection state machine, a drop is only shown once it outlasts the grace
+// period and a reconnect only resyncs once it has held for the settle time
+#define SETTINGS_KEY_CONNECTION_GRACE 105
+#define CONNECTION_GRACE_DEFAULT 10
+#define CONNECTION_SETTLE_MS 5000
+#define LINK_UP 0
+#define LINK_LOST 1
+#define LINK_DOWN 2
+#define LINK_SETTLING 3
+
 #define STATUS_REQUEST 1
 #define STATUS_REPLY 2
 
 #define BASIC_SIZE 21
 #define START_DATE_SIZE 18
-#define CLOSE_DATE_SIZE 6
-#define CLOSE_DAY_NAME_SIZE 10
+
+#define DAY_SECONDS (24 * 60 * 60)
+
+// Clock glyph sheet: digits 0-9 CLOCK_DIGIT_W wide each, then the colon
+#define CLOCK_GLYPHS 11
+#define CLOCK_GLYPH_COLON 10
+#define CLOCK_CELLS 5
+#define CLOCK_DIGIT_W 30
+#define CLOCK_COLON_W 14
+#define CLOCK_GLYPH_H 35
+#define CLOCK_Y 124
+
+// Calendar record formats. A v2 record is the index, a flags byte, the start
+// as a little endian uint32 timestamp and two int16 alarm offsets in minutes,
+// followed by the title and the location, each prefixed by a length byte.
+#define CALENDAR_FORMAT_V1 1
+#define CALENDAR_FORMAT_V2 2
+#define EVENT_V2_HEADER_SIZE 10
+#define EVENT_V2_ALL_DAY 0x01
+
+// Event titles and locations are packed into one arena as "title\0location\0",
+// each string cut at EVENT_TEXT_MAX - 1 characters, past what an event layer
+// shows before its ellipsis. The arena is sized for typical text and an event
+// takes what it needs while there is room. Once it is full every event is
+// still sure of EVENT_TEXT_SHARE bytes, taken back from those holding more.
+#define EVENT_TEXT_MAX 32
+#define EVENT_TEXT_SIZE 640
+#define EVENT_TEXT_SHARE (EVENT_TEXT_SIZE / MAX_EVENTS)
+
+// Events keep their alarms in minutes from the start, negative before it.
+// Zero or anything further away than this many seconds is no alarm.
+#define ALARM_MAX_OFFSET (14 * DAY_SECONDS)
+#define ALARM_TIMER_MAX_S DAY_SECONDS
+
+// Agenda pages go back to the normal view after this long without a tap
+#define AGENDA_TIMEOUT_MS 8000
 
 #define PERSIST_CONFIG_KEY 12434
 #define PERSIST_CONFIG_MS 500
+#define PERSIST_CONFIG_VERSION 1
+
+#define PERSIST_DIAGNOSTICS_KEY 199
+#define DIAGNOSTICS_RESET 2
+#define DIAGNOSTICS_FAIL_REASONS 16
 
+#define PERSIST_CALENDAR_KEY 200
+#define PERSIST_CALENDAR_FORMAT 4
+#define PERSIST_CALENDAR_TEXT_KEY 220
+#define EVENTS_PER_PERSIST ((int)(PERSIST_DATA_MAX_LENGTH / sizeof(Event)))
+
+// All settings, stored as one blob under PERSIST_CONFIG_KEY
 typedef struct {
+  uint8_t version;
   bool invert;
   bool animate;
   bool day_name;
   bool month_name;
   bool week_no;
+  uint8_t battery_step;
+  uint8_t quiet_start;
+  uint8_t quiet_end;
+  uint8_t low_battery;
+  uint8_t connection_grace;
 } ConfigData;
 
+// Event record as sent by phone apps using the v1 format
 typedef struct {
   uint8_t index;
   char title[BASIC_SIZE];
@@ -77,27 +195,66 @@ typedef struct {
   bool all_day;
   char start_date[START_DATE_SIZE];
   int32_t alarms[2];
+} EventV1;
+
+// Event as kept on the watch, decoded from either format. The text lives in
+// the arena, hash covers the record and the text as stored to spot changes.
+typedef struct {
+  time_t start;
+  uint32_t hash;
+  int16_t alarms[2];
+  uint16_t text;
+  uint8_t text_size;
+  bool all_day;
 } Event;
 
+// Strings of a record being decoded, pointing into the message
+typedef struct {
+  const char *title;
+  uint8_t title_len;
+  const char *location;
+  uint8_t location_len;
+} EventText;
+
+// Header of the persisted calendar, the events follow in chunks of
+// EVENTS_PER_PERSIST under the keys after PERSIST_CALENDAR_KEY and the
+// arena in chunks from PERSIST_CALENDAR_TEXT_KEY
+typedef struct {
+  uint8_t format;
+  uint8_t count;
+  uint16_t text_size;
+  uint32_t version;
+} CalendarCache;
+
+// Radio and I/O counters, returned on REQUEST_DIAGNOSTICS_KEY. Failures are
+// also counted per AppMessageResult, indexed by the bit the result sets.
+// Rejects are incoming payloads that failed validation and were dropped,
+// write errors requests that did not fit the outbox and stayed queued.
+typedef struct {
+  uint32_t outbox_sends;
+  uint32_t outbox_failures;
+  uint32_t bytes_sent;
+  uint32_t bytes_received;
+  uint32_t retry_timers;
+  uint32_t inbox_drops;
+  uint16_t fail_reasons[DIAGNOSTICS_FAIL_REASONS];
+  uint32_t decode_rejects;
+  uint32_t outbox_write_errors;
+} Diagnostics;
+
 typedef struct {
   uint8_t state;
   int8_t level;
 } BatteryStatus;
 
+// Texts of the event view, one per event layer
 typedef struct {
-  char date[CLOSE_DATE_SIZE];
-  char day_name[CLOSE_DAY_NAME_SIZE];
-} CloseDay;
-
-bool is_leap_year(int year) {
-  if (year % 400 == 0)
-    return true;
-  if (year % 100 == 0)
-    return false;
-  return (year % 4 == 0);
-}
+  char title[EVENT_TEXT_MAX];
+  char start_date[BASIC_SIZE];
+  char location[EVENT_TEXT_MAX];
+} EventView;
 
-int a_to_i(char *val, int len){
+static int a_to_i(const char *val, int len){
   int result = 0;
   for (int i = 0; i < len; i++) {
     if (val[i] < '0' || val[i] > '9')
@@ -108,34 +265,47 @@ int a_to_i(char *val, int len){
   return result;
 }
 
-void time_plus_day(struct tm *time, int daysToAdvance) {
+// Calendar math on day numbers, days since 1970-01-01 in the proleptic
+// Gregorian calendar. Months are 1-12. Constant time, after H. Hinnant's
+// days_from_civil.
+static int32_t days_from_civil(int y, int m, int d) {
+  y -= m <= 2;
+  int32_t era = (y >= 0 ? y : y - 399) / 400;
+  int32_t yoe = y - era * 400;
+  int32_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  int32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
 
-  int daysPerMonth[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+static int32_t days_from_tm(const struct tm *time) {
+  return days_from_civil(time->tm_year + 1900, time->tm_mon + 1, time->tm_mday);
+}
 
-  int year = time->tm_year + 1900;
-  int month = time->tm_mon + 1;
-  int day = time->tm_mday;
-  int wday = time->tm_wday;
-
-  for (int i = 0; i < daysToAdvance; i++) {
-    day++;
-    if (day > daysPerMonth[month - 1] || (month == 2 && day == 29 && !is_leap_year(year))) {
-      day = 1;
-      month++;
-      if (month == 13) {
-        month = 1;
-        year++;
-      }
-    }
-    wday++;
-    if (wday > 6)
-      wday = 0;
-  }
+// Day of the week as in tm_wday, 0 is Sunday
+static int weekday_from_days(int32_t z) {
+  return z >= -4 ? (z + 4) % 7 : (z + 5) % 7 + 6;
+}
+
+static int days_in_year(int year) {
+  return days_from_civil(year + 1, 1, 1) - days_from_civil(year, 1, 1);
+}
 
-  time->tm_year = year - 1900;
-  time->tm_mon = month - 1;
-  time->tm_mday = day;
-  time->tm_wday = wday;
+// ISO 8601 week number from the fields localtime fills in: weeks start on
+// Monday and week 1 holds the first Thursday. Week 0 of the tables is the
+// last week of the year before, and a week past the last one of this year is
+// week 1 of the next.
+static int iso_week_from_tm(const struct tm *time) {
+  int year = time->tm_year + 1900;
+  int jan1 = (time->tm_wday - time->tm_yday % 7 + 7) % 7;
+  int week = (time->tm_yday + iso_week_base[jan1]) / 7;
 
+  if (week == 0) {
+    int days = days_in_year(year - 1);
+    return iso_weeks_in_year[days == 366][(jan1 + 7 - days % 7) % 7];
+  }
+  if (week > iso_weeks_in_year[days_in_year(year) == 366][jan1])
+    return 1;
+  return week;
 }
-//#endif
\ No newline at end of file
+
+#endif
\ No newline at end of file
@@ -0,0 +1,128 @@
+#ifndef profile_h
+#define profile_h
+
+#include "pebble.h"
+
+// Opt-in timing of the layer update procs and the busiest handlers, built in
+// with ./waf configure --profile. Each slot counts durations in power-of-two
+// millisecond buckets: under 1 ms, under 2 ms, under 4 ms and so on, the last
+// bucket taking everything longer. The frame slot runs from the first layer
+// drawn to the last, so what it has on top of the update procs is the system
+// drawn text layers. Each slot also counts the calls that left the heap
+// bigger than they found it. The drawing slots should never do that, the
+// handlers only by the timers they arm. Without PROFILE only the wrapped
+// calls are left.
+
+#define PROFILE_LINE_LAYER 0
+#define PROFILE_CLOCK_CELL 1
+#define PROFILE_BATTERY_LAYER 2
+#define PROFILE_FRAME 3
+#define PROFILE_MINUTE_TICK 4
+#define PROFILE_MESSAGE_RECEIVE 5
+#define PROFILE_EVENT_DISPLAY 6
+#define PROFILE_EVENT_DATE 7
+#define PROFILE_SLOTS 8
+#define PROFILE_BUCKETS 8
+#define PROFILE_LOG_MINUTES 15
+
+#ifdef PROFILE
+
+typedef struct {
+  uint16_t buckets[PROFILE_BUCKETS];
+  uint16_t max_ms;
+  uint16_t heap_grew;
+} ProfileSlot;
+
+// Not static, so the host simulator can read the histograms directly. It
+// includes this header with PROFILE_EXTERN for the declaration alone.
+#ifdef PROFILE_EXTERN
+extern ProfileSlot profile[PROFILE_SLOTS];
+#else
+ProfileSlot profile[PROFILE_SLOTS];
+#endif
+
+static const char *const profile_names[PROFILE_SLOTS] = {
+  "line", "clock", "battery", "frame", "tick", "receive", "event", "date"
+};
+
+static Layer *profile_frame_start_layer;
+static Layer *profile_frame_end_layer;
+static uint32_t profile_frame_start;
+static size_t profile_frame_heap;
+
+static uint32_t profile_now_ms() {
+  time_t seconds;
+  uint16_t ms;
+  time_ms(&seconds, &ms);
+  return (uint32_t)seconds * 1000 + ms;
+}
+
+static void profile_record(int slot, uint32_t start, size_t heap) {
+  uint32_t ms = profile_now_ms() - start;
+  int bucket = 0;
+  while (bucket < PROFILE_BUCKETS - 1 && ms >= (1u << bucket))
+    bucket++;
+  if (profile[slot].buckets[bucket] < UINT16_MAX)
+    profile[slot].buckets[bucket]++;
+  if (ms > profile[slot].max_ms)
+    profile[slot].max_ms = ms > UINT16_MAX ? UINT16_MAX : ms;
+  if (heap_bytes_used() > heap && profile[slot].heap_grew < UINT16_MAX)
+    profile[slot].heap_grew++;
+}
+
+static void profile_tick(int minute) {
+  if (minute % PROFILE_LOG_MINUTES != 0)
+    return;
+  for (int i = 0; i < PROFILE_SLOTS; i++) {
+    uint16_t *b = profile[i].buckets;
+    APP_LOG(APP_LOG_LEVEL_INFO, "%s max %u ms: %u %u %u %u %u %u %u %u, heap grew %u", profile_names[i],
+            profile[i].max_ms, b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7], profile[i].heap_grew);
+  }
+}
+
+static void profile_frame_start_update(Layer *layer, GContext *ctx) {
+  profile_frame_start = profile_now_ms();
+  profile_frame_heap = heap_bytes_used();
+}
+
+static void profile_frame_end_update(Layer *layer, GContext *ctx) {
+  profile_record(PROFILE_FRAME, profile_frame_start, profile_frame_heap);
+}
+
+// Put empty marker layers under and over everything else in root. Call the
+// start before any other layer is added and the end after the last one.
+static void profile_attach_start(Layer *root) {
+  profile_frame_start_layer = layer_create(GRect(0, 0, 1, 1));
+  layer_set_update_proc(profile_frame_start_layer, profile_frame_start_update);
+  layer_add_child(root, profile_frame_start_layer);
+}
+
+static void profile_attach_end(Layer *root) {
+  profile_frame_end_layer = layer_create(GRect(0, 0, 1, 1));
+  layer_set_update_proc(profile_frame_end_layer, profile_frame_end_update);
+  layer_add_child(root, profile_frame_end_layer);
+}
+
+static void profile_detach() {
+  layer_destroy(profile_frame_start_layer);
+  layer_destroy(profile_frame_end_layer);
+}
+
+#define PROFILE_CALL(slot, call) do { \
+    uint32_t profile_start = profile_now_ms(); \
+    size_t profile_heap = heap_bytes_used(); \
+    call; \
+    profile_record(slot, profile_start, profile_heap); \
+  } while (0)
+
+#else
+
+#define PROFILE_CALL(slot, call) call
+#define profile_tick(minute)
+#define profile_attach_start(root)
+#define profile_attach_end(root)
+#define profile_detach()
+
+#endif
+
+#endif
@@ -28,6 +28,8 @@
  */
 
 #include "common.h"
+#include "profile.h"
+#include "trace.h"
 
 #define TODAY "Today"
 #define TOMORROW "Tomorrow"
@@ -36,7 +38,6 @@
 // Window, Layer, and Bitmap declarations
 static Window 		*window;
 static TextLayer 	*text_date_layer;
-static TextLayer 	*text_time_layer;
 static TextLayer 	*text_week_layer;
 static TextLayer 	*text_event_title_layer;
 static TextLayer 	*text_event_start_date_layer;
@@ -45,93 +46,139 @@ static Layer 			*line_layer;
 static Layer 			*battery_layer;
 static GBitmap 		*icon_battery;
 
+// Clock drawn from the CLOCK_DIGITS sheet. Each glyph cell is its own small
+// layer holding its glyph, so a minute only repaints the cells that changed.
+static GBitmap 		*clock_sheet;
+static GBitmap 		*clock_glyphs[CLOCK_GLYPHS];
+static Layer 			*clock_cells[CLOCK_CELLS];
+static int 	clock_glyph_count = 0;
+static bool clock_inverted = false;
+
+// Cell x offsets for "H:MM" and "HH:MM", centered on the screen
+static const int16_t clock_cell_x[2][CLOCK_CELLS] = {
+  { 20, 50, 64, 94, 0 },
+  { 5, 35, 65, 79, 109 }
+};
+
+// Settings, flash writes wait for PERSIST_CONFIG_MS of quiet
+static ConfigData config;
+static AppTimer *config_timer;
+
 // Connected info
 //static bool bluetooth_state_changed = false;
-static bool app_state_changed = true;
 static bool bluetooth_connected = true;
 static bool app_connected = true;
+static uint8_t link_state = LINK_UP;
+static AppTimer *link_timer;
+static bool link_bt_lost;
 static int 	current_day_number = 0;
 
-// Event array for storing two events
-Event 			event[2];
-Event 			last_event[2];
+// Event array for storing the calendar, filled in batches by the phone
+Event 			event[MAX_EVENTS];
+// Titles and locations of the events, see EVENT_TEXT_SIZE
+static char event_text[EVENT_TEXT_SIZE];
+static uint16_t event_text_used;
 static int	event_count;
-static char week_text[] = "W 00";
-static int 	alarm_event = 0;
-static char event_start_date_static[BASIC_SIZE];
+static int	calendar_request_index;
+static uint32_t calendar_version;
+// Slots the transfer under way has filled. The events shown, event_count and
+// event_order, only change once every slot of the new calendar is in.
+static uint32_t calendar_received;
+// What differs from the calendar in persistent storage
+static bool calendar_changed;
+static uint32_t calendar_saved_version;
+static uint8_t calendar_batch_capacity = 1;
+static uint16_t calendar_inbox_bytes;
+
+// Upcoming alarms as a min-heap of timestamps, one timer armed for the first
+static time_t alarm_heap[MAX_ALARMS];
+static int	alarm_count;
+static AppTimer *alarm_timer;
+
+// Selected event as it should be shown, and what the event layers show now.
+// The layers differ from the model while a connection warning is up.
+static EventView event_view;
+static EventView shown_view;
+static bool warning_shown = false;
+static const char *warning_message;
+
+// Position in event_order shown while paging through the agenda with wrist
+// taps, -1 otherwise
+static int agenda_page = -1;
+static AppTimer *agenda_timer;
+
+// Events by start time, and a timer for the next time the selection or the
+// day names in the view change
+static uint8_t event_order[MAX_EVENTS];
+static AppTimer *expiry_timer;
+
+// Counters kept across restarts, saved every hour
+static Diagnostics diagnostics;
+#ifndef SIMPLICITY_MINIMAL
+static Diagnostics diagnostics_reply;
+#endif
 
 // Itit battery status
 BatteryStatus battery_status;
-static CloseDay g_close[7];
+// Room for any int8_t level, the phone reports -1 while it does not know
+static char battery_text[] = "-128 %";
+
+// Power governor
+static uint8_t power_policy = POWER_NORMAL;
+// While saving power the phone battery waits here, the gauge keeps its value
+static BatteryStatus battery_pending;
+static bool battery_layer_stale;
+// Minutes between calendar checks for each policy, 0 waits for the phone to push
+static const uint8_t power_poll_minutes[] = { 10, 30, 60, 0 };
 static int g_last_tm_mday = -1;
+static time_t g_today_start;
+static int32_t g_today;
 
-// Build a cache of dates vs day names
-static void ensure_close_day_cache() {
+// Start of today and its day number, for naming the days of the coming week
+static void ensure_today() {
   time_t now = time(NULL);
   struct tm *now_tm = localtime(&now);
 
-  struct tm fiddle;
-
   if (now_tm->tm_mday == g_last_tm_mday)
     return;
 
   g_last_tm_mday = now_tm->tm_mday;
-
-  for (int i = 0; i < 7; i++) {
-    memcpy(&fiddle, now_tm, sizeof(fiddle));
-    if (i > 0)
-      time_plus_day(&fiddle, i);
-    strftime(g_close[i].date, CLOSE_DATE_SIZE, "%m/%d", &fiddle);
-    strftime(g_close[i].day_name, CLOSE_DAY_NAME_SIZE, "%A", &fiddle);
-  }
-  strcpy(g_close[0].day_name, TODAY);
-  strcpy(g_close[1].day_name, TOMORROW);
+  g_today_start = now - (now_tm->tm_hour * 60 * 60 + now_tm->tm_min * 60 + now_tm->tm_sec);
+  g_today = days_from_tm(now_tm);
 }
 
-static void modify_calendar_time(char *output, int outlen, char *date, bool all_day) {
+static void modify_calendar_time(char *output, int outlen, time_t start, bool all_day) {
 
-  // When "Show next events" is turned off in the app:
-  // MM/dd
-  // When "Show next events" is turned on:
-  // MM/dd/yy
+  // Day name within the coming week, month and day further out:
+  // Tomorrow 9:30
+  // Jun 12 - All day
+  // If clock style is 12h, AM/PM is added.
+  ensure_today();
 
-  // If all_day is false, time is added like so:
-  // MM/dd(/yy) H:mm
-  // If clock style is 12h, AM/PM is added:
-  // MM/dd(/yy) H:mm a
-  // Build a list of dates and day names closest to the current date
-  ensure_close_day_cache();
-
-  int time_position = 9;
-  if (date[5] != '/')
-    time_position = 6;
-
-  // Find the date in the list prepared
   char temp[12];
-  bool found = false;
-  for (int i = 0; i < 7; i++) {
-    if (strncmp(g_close[i].date, date, 5) == 0) {
-      strncpy(temp, g_close[i].day_name, sizeof(temp));
-      found = true;
-      break;
-    }
+  struct tm start_tm;
+  memcpy(&start_tm, localtime(&start), sizeof(start_tm));
+
+  // Without day names only Today and Tomorrow are spelled out. Counted in
+  // day numbers, so a day made short or long by DST still counts as one.
+  int32_t offset = days_from_tm(&start_tm) - g_today;
+  if (offset >= 0 && offset < (config.day_name ? 7 : 2)) {
+    strncpy(temp, offset == 0 ? TODAY : offset == 1 ? TOMORROW : weekday_names[weekday_from_days(g_today + offset)], sizeof(temp));
+  } else if (config.month_name) {
+    snprintf(temp, sizeof(temp), "%s %2d -", month_names[start_tm.tm_mon], start_tm.tm_mday);
+  } else {
+    snprintf(temp, sizeof(temp), "%02d/%02d -", (uint8_t)start_tm.tm_mday, (uint8_t)(start_tm.tm_mon + 1));
   }
 
-  // If not found then show the month and the day
-  if (!found) {
-    time_t now = time(NULL);
-    struct tm *now_tm = localtime(&now);
-    struct tm fiddle;
-    memcpy(&fiddle, now_tm, sizeof(fiddle));
-    fiddle.tm_mday = a_to_i(&date[3], 2);
-    fiddle.tm_mon = a_to_i(&date[0], 2) - 1;
-    strftime(temp, sizeof(temp), "%b %e -", &fiddle);
-  }
   // Change the format based on whether there is a timestamp
-  if (all_day)
+  if (all_day) {
     snprintf(output, outlen, "%s %s", temp, ALL_DAY);
-  else
-    snprintf(output, outlen, "%s %s", temp, &date[time_position]);
+  } else {
+    char clock[9];
+    strftime(clock, sizeof(clock), clock_is_24h_style() ? "%R" : "%I:%M %p", &start_tm);
+    // No leading zero on the hour, as the phone app formats it
+    snprintf(output, outlen, "%s %s", temp, clock[0] == '0' ? &clock[1] : clock);
+  }
 }
 
 // Vibe generator 
@@ -168,85 +215,750 @@ void generate_vibe(uint32_t vibe_pattern_number) {
   }
 }
 
-void line_layer_update_callback(Layer *layer, GContext *ctx) {
+// Turn a v1 start date, "MM/dd(/yy) H:mm( a)", into a timestamp.
+// Without a year the date is taken to be within the next half year.
+static time_t parse_start_date(const char *date, bool all_day) {
+  time_t now = time(NULL);
+  struct tm start;
+  memcpy(&start, localtime(&now), sizeof(start));
+
+  int time_position = 9;
+  if (date[5] != '/')
+    time_position = 6;
+
+  start.tm_mon = a_to_i(&date[0], 2) - 1;
+  start.tm_mday = a_to_i(&date[3], 2);
+  if (time_position == 9)
+    start.tm_year = a_to_i(&date[6], 2) + 100;
+  start.tm_hour = 0;
+  start.tm_min = 0;
+  start.tm_sec = 0;
+
+  if (!all_day && strlen(date) > (size_t)time_position) {
+    const char *clock = &date[time_position];
+    const char *minutes = strchr(clock, ':');
+    start.tm_hour = a_to_i(clock, 2);
+    if (minutes)
+      start.tm_min = a_to_i(minutes + 1, 2);
+    if (strchr(clock, 'P') || strchr(clock, 'p')) {
+      if (start.tm_hour < 12)
+        start.tm_hour += 12;
+    } else if ((strchr(clock, 'A') || strchr(clock, 'a')) && start.tm_hour == 12) {
+      start.tm_hour = 0;
+    }
+  }
+
+  // The date may be on the other side of a DST change from now, so mktime
+  // works out the offset for it. It fills in tm_isdst, clear it again too.
+  start.tm_isdst = -1;
+  time_t result = mktime(&start);
+  if (time_position == 6 && result < now - 183 * DAY_SECONDS) {
+    start.tm_year++;
+    start.tm_isdst = -1;
+    result = mktime(&start);
+  }
+  return result;
+}
+
+// Fields are little endian and may sit unaligned in the message
+static uint32_t read_le32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t read_le16(const uint8_t *p) {
+  return p[0] | p[1] << 8;
+}
+
+static bool terminated(const uint8_t *field, int size) {
+  return memchr(field, '\0', size) != NULL;
+}
+
+// Size of the record at data, or 0 when it is malformed or runs past length.
+// v1 strings must end inside their fields, v2 strings inside the record and
+// without a NUL of their own, which would hide the rest from the arena.
+static int check_event(uint8_t format, const uint8_t *data, int length) {
+  if (format == CALENDAR_FORMAT_V1) {
+    if (length < (int)sizeof(EventV1) ||
+        !terminated(data + offsetof(EventV1, title), BASIC_SIZE) ||
+        !terminated(data + offsetof(EventV1, location), BASIC_SIZE) ||
+        !terminated(data + offsetof(EventV1, start_date), START_DATE_SIZE) ||
+        strlen((const char *)data + offsetof(EventV1, start_date)) < 5)
+      return 0;
+    return sizeof(EventV1);
+  }
+
+  int pos = EVENT_V2_HEADER_SIZE;
+  for (int i = 0; i < 2; i++) {
+    if (pos >= length || pos + 1 + data[pos] > length || terminated(data + pos + 1, data[pos]))
+      return 0;
+    pos += 1 + data[pos];
+  }
+  return pos;
+}
+
+// A payload is valid only when exactly count valid records fill it. Nothing
+// is applied before the whole payload has passed.
+static bool check_records(uint8_t format, const uint8_t *data, int length, int count) {
+  for (int i = 0; i < count; i++) {
+    int used = check_event(format, data, length);
+    if (used == 0)
+      return false;
+    data += used;
+    length -= used;
+  }
+  return length == 0;
+}
+
+// v1 alarms are seconds, kept as minutes. Out of range they are no alarm.
+static int16_t alarm_minutes(int32_t seconds) {
+  return seconds >= -ALARM_MAX_OFFSET && seconds <= ALARM_MAX_OFFSET ? seconds / 60 : 0;
+}
+
+// Read the checked record at data into its slot index and e, with its strings
+// left in the message and pointed out by text. Returns the bytes used.
+static int decode_event(uint8_t format, const uint8_t *data, uint8_t *index, Event *e, EventText *text) {
+  if (format == CALENDAR_FORMAT_V1) {
+    *index = data[offsetof(EventV1, index)];
+    e->all_day = data[offsetof(EventV1, all_day)];
+    e->start = parse_start_date((const char *)data + offsetof(EventV1, start_date), e->all_day);
+    e->alarms[0] = alarm_minutes(read_le32(data + offsetof(EventV1, alarms)));
+    e->alarms[1] = alarm_minutes(read_le32(data + offsetof(EventV1, alarms) + sizeof(int32_t)));
+    text->title = (const char *)data + offsetof(EventV1, title);
+    text->title_len = strlen(text->title);
+    text->location = (const char *)data + offsetof(EventV1, location);
+    text->location_len = data[offsetof(EventV1, has_location)] ? strlen(text->location) : 0;
+    return sizeof(EventV1);
+  }
+
+  *index = data[0];
+  e->all_day = data[1] & EVENT_V2_ALL_DAY;
+  e->start = (time_t)read_le32(&data[2]);
+  e->alarms[0] = (int16_t)read_le16(&data[6]);
+  e->alarms[1] = (int16_t)read_le16(&data[8]);
+
+  int pos = EVENT_V2_HEADER_SIZE;
+  text->title_len = data[pos];
+  text->title = (const char *)&data[pos + 1];
+  pos += 1 + text->title_len;
+  text->location_len = data[pos];
+  text->location = (const char *)&data[pos + 1];
+  return pos + 1 + text->location_len;
+}
+
+static const char *event_title(int i) {
+  return event[i].text_size ? &event_text[event[i].text] : "";
+}
+
+static const char *event_location(int i) {
+  const char *title = event_title(i);
+  return event[i].text_size ? title + strlen(title) + 1 : "";
+}
+
+// FNV-1a over the record and its text
+static uint32_t hash_bytes(uint32_t hash, const void *data, int length) {
+  const uint8_t *bytes = data;
+  for (int i = 0; i < length; i++)
+    hash = (hash ^ bytes[i]) * 16777619u;
+  return hash;
+}
+
+static uint32_t hash_event(const Event *e, const EventText *text) {
+  uint32_t hash = 2166136261u;
+  hash = hash_bytes(hash, text->title, text->title_len);
+  hash = hash_bytes(hash, &text->title_len, 1);
+  hash = hash_bytes(hash, text->location, text->location_len);
+  hash = hash_bytes(hash, &text->location_len, 1);
+  hash = hash_bytes(hash, &e->start, sizeof(e->start));
+  hash = hash_bytes(hash, e->alarms, sizeof(e->alarms));
+  return hash_bytes(hash, &e->all_day, 1);
+}
+
+// Slide the text still in use to the front of the arena, lowest offset first
+// so nothing is overwritten before it has moved
+static void compact_event_text() {
+  uint16_t used = 0;
+  int from = 0;
+  for (;;) {
+    int next = -1;
+    for (int i = 0; i < MAX_EVENTS; i++) {
+      if (event[i].text_size && event[i].text >= from && (next < 0 || event[i].text < event[next].text))
+        next = i;
+    }
+    if (next < 0)
+      break;
+    from = event[next].text + 1;
+    memmove(&event_text[used], &event_text[event[next].text], event[next].text_size);
+    event[next].text = used;
+    used += event[next].text_size;
+  }
+  event_text_used = used;
+}
+
+// Events from count on are gone, their text can be reused
+static void release_events_from(int count) {
+  for (int i = count; i < MAX_EVENTS; i++)
+    event[i].text_size = 0;
+}
+
+// Arena bytes held by every event but except, -1 for all of them
+static int event_text_held(int except) {
+  int held = 0;
+  for (int i = 0; i < MAX_EVENTS; i++) {
+    if (i != except)
+      held += event[i].text_size;
+  }
+  return held;
+}
+
+// Cut text to size bytes with its two NULs, the end of the location first
+static void fit_event_text(EventText *text, int size) {
+  int room = size - 2;
+  if (text->title_len > room)
+    text->title_len = room;
+  if (text->title_len + text->location_len > room)
+    text->location_len = room - text->title_len;
+}
+
+// Cut the text of event i to size bytes where it is. Its hash follows what
+// is left, so the event is stored again when the phone sends it next and
+// gets its text back once there is room.
+static void cut_event_text(int i, int size) {
+  char *title = &event_text[event[i].text];
+  const char *location = title + strlen(title) + 1;
+  EventText kept = { title, strlen(title), location, strlen(location) };
+  fit_event_text(&kept, size);
+  title[kept.title_len] = '\0';
+  memmove(&title[kept.title_len + 1], location, kept.location_len);
+  title[kept.title_len + 1 + kept.location_len] = '\0';
+  kept.location = &title[kept.title_len + 1];
+  event[i].text_size = kept.title_len + kept.location_len + 2;
+  event[i].hash = hash_event(&event[i], &kept);
+}
+
+// Put a decoded record in slot i, copying its text into the arena. Slots in
+// spare are about to be filled again or freed, their text goes first when
+// the arena is short. Returns false when the slot already holds the same event.
+static bool store_event(int i, const Event *record, const EventText *text, uint32_t spare) {
+  EventText kept = *text;
+  if (kept.title_len > EVENT_TEXT_MAX - 1)
+    kept.title_len = EVENT_TEXT_MAX - 1;
+  if (kept.location_len > EVENT_TEXT_MAX - 1)
+    kept.location_len = EVENT_TEXT_MAX - 1;
+
+  // The hash is of what was stored, so an event cut short for lack of room
+  // is stored again when it comes back and gets its full text once it fits
+  uint32_t hash = hash_event(record, &kept);
+  // A slot holds an event as long as it holds text, at least the two NULs
+  bool held = event[i].text_size != 0;
+  uint32_t held_hash = event[i].hash;
+  if (held && held_hash == hash)
+    return false;
+
+  event[i] = *record;
+  event[i].text_size = 0;
+
+  int size = kept.title_len + kept.location_len + 2;
+  int room = EVENT_TEXT_SIZE - event_text_held(-1);
+  int sure = size < EVENT_TEXT_SHARE ? size : EVENT_TEXT_SHARE;
+  for (int j = 0; j < MAX_EVENTS && room < size; j++) {
+    if (spare & (1u << j)) {
+      room += event[j].text_size;
+      event[j].text_size = 0;
+    }
+  }
+  // With the arena full, what is missing of the share comes from the event
+  // holding the most. The others hold no more than the arena less this share,
+  // so one of them holds more than its own.
+  while (room < sure) {
+    int most = 0;
+    for (int j = 1; j < MAX_EVENTS; j++) {
+      if (event[j].text_size > event[most].text_size)
+        most = j;
+    }
+    int taken = event[most].text_size - EVENT_TEXT_SHARE;
+    if (taken > sure - room)
+      taken = sure - room;
+    cut_event_text(most, event[most].text_size - taken);
+    room += taken;
+  }
+  if (size > room)
+    size = room;
+  fit_event_text(&kept, size);
+  if (event_text_used + size > EVENT_TEXT_SIZE)
+    compact_event_text();
+
+  char *out = &event_text[event_text_used];
+  memcpy(out, kept.title, kept.title_len);
+  out[kept.title_len] = '\0';
+  memcpy(&out[kept.title_len + 1], kept.location, kept.location_len);
+  out[kept.title_len + 1 + kept.location_len] = '\0';
+  event[i].text = event_text_used;
+  event[i].text_size = kept.title_len + kept.location_len + 2;
+  event_text_used += event[i].text_size;
+  event[i].hash = hash_event(record, &kept);
+  return !held || event[i].hash != held_hash;
+}
+
+static void alarm_heap_push(time_t when) {
+  if (alarm_count >= MAX_ALARMS)
+    return;
+  int i = alarm_count++;
+  while (i > 0 && alarm_heap[(i - 1) / 2] > when) {
+    alarm_heap[i] = alarm_heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  alarm_heap[i] = when;
+}
+
+static void alarm_heap_pop() {
+  time_t last = alarm_heap[--alarm_count];
+  int i = 0;
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= alarm_count)
+      break;
+    if (child + 1 < alarm_count && alarm_heap[child + 1] < alarm_heap[child])
+      child++;
+    if (alarm_heap[child] >= last)
+      break;
+    alarm_heap[i] = alarm_heap[child];
+    i = child;
+  }
+  alarm_heap[i] = last;
+}
+
+static void handle_alarm_timer(void *data);
+
+static void arm_alarm_timer() {
+  if (alarm_count == 0) {
+    if (alarm_timer) {
+      app_timer_cancel(alarm_timer);
+      alarm_timer = NULL;
+    }
+    return;
+  }
+
+  // Long waits are split up, the timer just re-arms when nothing is due
+  time_t delay = alarm_heap[0] - time(NULL);
+  if (delay < 0)
+    delay = 0;
+  if (delay > ALARM_TIMER_MAX_S)
+    delay = ALARM_TIMER_MAX_S;
+  // Timers come from the app heap, move the pending one instead of replacing it
+  if (alarm_timer)
+    app_timer_reschedule(alarm_timer, delay * 1000);
+  else
+    alarm_timer = app_timer_register(delay * 1000, &handle_alarm_timer, NULL);
+}
+
+static void handle_alarm_timer(void *data) {
+  alarm_timer = NULL;
+
+  // Timers may fire slightly early, allow a second of slack
+  time_t now = time(NULL) + 1;
+  bool due = false;
+  while (alarm_count > 0 && alarm_heap[0] <= now) {
+    alarm_heap_pop();
+    due = true;
+  }
+  if (due)
+    generate_vibe(8);
+
+  arm_alarm_timer();
+}
+
+// Vibrate at the start of every timed event and at each of its alarms
+static void schedule_alarms() {
+  time_t now = time(NULL);
+  alarm_count = 0;
+
+  for (int i = 0; i < event_count; i++) {
+    time_t start = event[i].start;
+    if (!event[i].all_day && start > now)
+      alarm_heap_push(start);
+    for (int j = 0; j < 2; j++) {
+      int32_t offset = event[i].alarms[j] * 60;
+      if (offset != 0 && offset >= -ALARM_MAX_OFFSET && offset <= ALARM_MAX_OFFSET && start + offset > now)
+        alarm_heap_push(start + offset);
+    }
+  }
+  arm_alarm_timer();
+}
+
+// Set the text of a layer backed by buffer. text_layer_set_text dirties the
+// layer, so it is skipped when the text has not changed.
+static void set_text_if_changed(TextLayer *layer, char *buffer, int size, const char *text) {
+  if (strncmp(buffer, text, size - 1) == 0 && text_layer_get_text(layer) == buffer)
+    return;
+  strncpy(buffer, text, size - 1);
+  buffer[size - 1] = '\0';
+  text_layer_set_text(layer, buffer);
+}
+
+// Put the event view on the layers, unless a warning is being shown.
+// Paging the agenda shows the cached events over the warning.
+static void commit_event_view() {
+  if (warning_shown && agenda_page < 0)
+    return;
+  set_text_if_changed(text_event_title_layer, shown_view.title, sizeof(shown_view.title), event_view.title);
+  set_text_if_changed(text_event_start_date_layer, shown_view.start_date, sizeof(shown_view.start_date), event_view.start_date);
+  set_text_if_changed(text_event_location_layer, shown_view.location, sizeof(shown_view.location), event_view.location);
+}
+
+// Replace the event view with a warning until clear_warning()
+static void show_warning(const char *message) {
+  warning_message = message;
+  warning_shown = true;
+  if (agenda_page >= 0)
+    return;
+  set_text_if_changed(text_event_start_date_layer, shown_view.start_date, sizeof(shown_view.start_date), message);
+  set_text_if_changed(text_event_title_layer, shown_view.title, sizeof(shown_view.title), "WARNING!");
+  set_text_if_changed(text_event_location_layer, shown_view.location, sizeof(shown_view.location), "");
+}
+
+static void clear_warning() {
+  warning_shown = false;
+  commit_event_view();
+}
+
+// The line layer only covers the two lines at y=94/95
+static void draw_line_layer(Layer *layer, GContext *ctx) {
   graphics_context_set_stroke_color(ctx, GColorWhite);
-  graphics_draw_line(ctx, GPoint(8, 94), GPoint(131, 94));
-  graphics_draw_line(ctx, GPoint(8, 95), GPoint(131, 95));
+  graphics_draw_line(ctx, GPoint(0, 0), GPoint(123, 0));
+  graphics_draw_line(ctx, GPoint(0, 1), GPoint(123, 1));
 }
 
-void battery_layer_update_callback(Layer *layer, GContext *ctx) {
+void line_layer_update_callback(Layer *layer, GContext *ctx) {
+  PROFILE_CALL(PROFILE_LINE_LAYER, draw_line_layer(layer, ctx));
+}
+
+static void draw_clock_cell(Layer *layer, GContext *ctx) {
+  int8_t glyph = *(int8_t *)layer_get_data(layer);
+  if (glyph < 0)
+    return;
+  // The sheet is white digits on black. Or lets only the white through onto
+  // the black background, Clear turns it black on the white inverse one.
+  graphics_context_set_compositing_mode(ctx, clock_inverted ? GCompOpClear : GCompOpOr);
+  graphics_draw_bitmap_in_rect(ctx, clock_glyphs[glyph], layer_get_bounds(layer));
+}
+
+void clock_cell_update_callback(Layer *layer, GContext *ctx) {
+  PROFILE_CALL(PROFILE_CLOCK_CELL, draw_clock_cell(layer, ctx));
+}
+
+static void update_clock(struct tm *tick_time) {
+  int8_t glyphs[CLOCK_CELLS];
+  int hour = tick_time->tm_hour;
+  int n = 0;
+
+  // No leading zero on the hour for the twelve hour clock
+  if (!clock_is_24h_style()) {
+    hour = hour % 12;
+    if (hour == 0)
+      hour = 12;
+  }
+  if (clock_is_24h_style() || hour >= 10)
+    glyphs[n++] = hour / 10;
+  glyphs[n++] = hour % 10;
+  glyphs[n++] = CLOCK_GLYPH_COLON;
+  glyphs[n++] = tick_time->tm_min / 10;
+  glyphs[n++] = tick_time->tm_min % 10;
+
+  bool relayout = n != clock_glyph_count;
+  clock_glyph_count = n;
+
+  for (int i = 0; i < CLOCK_CELLS; i++) {
+    if (relayout) {
+      layer_set_hidden(clock_cells[i], i >= n);
+      if (i < n) {
+        int16_t w = glyphs[i] == CLOCK_GLYPH_COLON ? CLOCK_COLON_W : CLOCK_DIGIT_W;
+        layer_set_frame(clock_cells[i], GRect(clock_cell_x[n - 4][i], CLOCK_Y, w, CLOCK_GLYPH_H));
+      }
+    }
+    int8_t *glyph = layer_get_data(clock_cells[i]);
+    if (i < n && *glyph != glyphs[i]) {
+      *glyph = glyphs[i];
+      layer_mark_dirty(clock_cells[i]);
+    }
+  }
+}
+
+static void draw_battery_layer(Layer *layer, GContext *ctx) {
   graphics_context_set_compositing_mode(ctx, GCompOpAssignInverted);
   graphics_draw_bitmap_in_rect(ctx, icon_battery, GRect(35, 0, 24, 12));
 
   if (battery_status.state != 0 && battery_status.level >= 0 && battery_status.level <= 100) {
-    int num = snprintf(NULL, 0, "%d %%", battery_status.level);
-    char *str = malloc(num + 1);
-    snprintf(str, num + 1, "%d %%", battery_status.level);
-
-    graphics_draw_text(ctx, str, fonts_get_system_font(FONT_KEY_GOTHIC_14), GRect(-2, -3, 35-3, 14), 0, GTextAlignmentRight, NULL);
-
-    free(str);
+    graphics_draw_text(ctx, battery_text, fonts_get_system_font(FONT_KEY_GOTHIC_14), GRect(-2, -3, 35-3, 14), 0, GTextAlignmentRight, NULL);
 
     if (battery_status.level > 0) {
       graphics_context_set_stroke_color(ctx, GColorBlack);
       graphics_context_set_fill_color(ctx, GColorWhite);
-      graphics_fill_rect(ctx, GRect(38, 3, (uint8_t)((battery_status.level / 100.0) * 16.0), 6), 0, GCornerNone);
+      graphics_fill_rect(ctx, GRect(38, 3, battery_status.level * 16 / 100, 6), 0, GCornerNone);
     }
   }
 }
 
-void handle_request_battery_data(void *data) {
-  DictionaryIterator *iter;
-  app_message_outbox_begin(&iter);
+void battery_layer_update_callback(Layer *layer, GContext *ctx) {
+  PROFILE_CALL(PROFILE_BATTERY_LAYER, draw_battery_layer(layer, ctx));
+}
+
+// Outbox queue. Requests are merged while they wait and sent one at a time,
+// the next one going out when the phone acknowledged the last.
+static uint8_t outbox_pending;
+static uint8_t outbox_in_flight;
+static uint32_t outbox_backoff_ms = OUTBOX_RETRY_MIN_MS;
+static AppTimer *outbox_timer;
+// Outbox begun for requests that all failed to write, used for the next try
+static DictionaryIterator *outbox_unsent;
 
-  if (!iter) {
-    app_timer_register(1000, &handle_request_battery_data, NULL);
+static void handle_outbox_timer(void *data);
+
+static void schedule_outbox(uint32_t delay_ms) {
+  if (outbox_timer || outbox_in_flight || !outbox_pending)
     return;
-  }
+  outbox_timer = app_timer_register(delay_ms, &handle_outbox_timer, NULL);
+}
 
-  dict_write_uint8(iter, REQUEST_BATTERY_KEY, 1);
-  app_message_outbox_send();
+// Wait before trying again, twice as long each time up to OUTBOX_RETRY_MAX_MS
+static void retry_later() {
+  diagnostics.retry_timers++;
+  schedule_outbox(outbox_backoff_ms);
+  outbox_backoff_ms *= 2;
+  if (outbox_backoff_ms > OUTBOX_RETRY_MAX_MS)
+    outbox_backoff_ms = OUTBOX_RETRY_MAX_MS;
 }
 
-void handle_request_calendar_data(void *data){
-  DictionaryIterator *iter;
-  app_message_outbox_begin(&iter);
-  
+// The link is back, try now instead of waiting out the backoff
+static void reset_outbox_backoff() {
+  outbox_backoff_ms = OUTBOX_RETRY_MIN_MS;
+  if (outbox_timer)
+    app_timer_reschedule(outbox_timer, 100);
+}
+
+// Queue a request, it merges with the same request if one is waiting
+static void queue_request(uint8_t request, uint32_t delay_ms) {
+  outbox_pending |= request;
+  schedule_outbox(delay_ms);
+}
+
+static DictionaryResult write_calendar_request(DictionaryIterator *iter) {
+  DictionaryResult result = dict_write_int8(iter, REQUEST_CALENDAR_KEY, calendar_request_index);
+  uint8_t clock_style = clock_is_24h_style() ? CLOCK_STYLE_24H : CLOCK_STYLE_12H;
+  result |= dict_write_uint8(iter, CLOCK_STYLE_KEY, clock_style);
+  // Tell the phone how many events fit in one response
+  result |= dict_write_uint8(iter, CALENDAR_BATCH_KEY, calendar_batch_capacity);
+  // and which calendar we hold, so it can answer with only what changed
+  result |= dict_write_uint32(iter, CALENDAR_VERSION_KEY, calendar_version);
+  // v2 records are packed by size rather than count
+  result |= dict_write_uint8(iter, CALENDAR_FORMAT_KEY, CALENDAR_FORMAT_V2);
+  result |= dict_write_uint16(iter, CALENDAR_INBOX_KEY, calendar_inbox_bytes);
+  return result;
+}
+
+static DictionaryResult write_battery_request(DictionaryIterator *iter) {
+  // Ask for the level once and have the phone push it again only when it
+  // moves by the step or the charging state changes
+  DictionaryResult result = dict_write_uint8(iter, REQUEST_BATTERY_KEY, 1);
+  result |= dict_write_uint8(iter, BATTERY_STEP_KEY, config.battery_step);
+  return result;
+}
+
+// Write one queued request into the outbox, DICT_OK when all of it fit
+static DictionaryResult write_request(DictionaryIterator *iter, uint8_t request) {
+  switch (request) {
+    case OUTBOX_CALENDAR:
+      return write_calendar_request(iter);
+    case OUTBOX_BATTERY:
+      return write_battery_request(iter);
+#ifdef TRACE
+    case OUTBOX_TRACE: {
+      uint8_t chunk[TRACE_CHUNK];
+      DictionaryResult result = dict_write_data(iter, TRACE_RESPONSE_KEY, chunk, trace_chunk(chunk));
+      result |= dict_write_uint16(iter, TRACE_OFFSET_KEY, trace_dump_pos);
+      result |= dict_write_uint16(iter, TRACE_TOTAL_KEY, trace_used);
+      return result;
+    }
+#endif
+#ifndef SIMPLICITY_MINIMAL
+    case OUTBOX_DIAGNOSTICS:
+      return dict_write_data(iter, DIAGNOSTICS_RESPONSE_KEY, (uint8_t *)&diagnostics_reply, sizeof(diagnostics_reply));
+#endif
+  }
+  return DICT_INVALID_ARGS;
+}
+
+// Every request goes out whole in one outbox, a tuple that does not fit is
+// not written. OUTBOX_SIZE follows the largest request and must stay within
+// what any firmware grants.
+_Static_assert(OUTBOX_DIAGNOSTICS_SIZE <= OUTBOX_SIZE, "the diagnostics reply does not fit the outbox");
+#ifdef TRACE
+_Static_assert(DICT_SIZE(3, TRACE_CHUNK + 2 + 2) <= OUTBOX_SIZE, "a trace chunk does not fit the outbox");
+#endif
+_Static_assert(OUTBOX_SIZE <= APP_MESSAGE_OUTBOX_SIZE_MINIMUM, "the outbox is larger than the firmware grants");
+
+static void handle_outbox_timer(void *data) {
+  outbox_timer = NULL;
+  if (outbox_in_flight || !outbox_pending)
+    return;
+
+  if (!bluetooth_connected) {
+    retry_later();
+    return;
+  }
+
+  // A begun outbox cannot be handed back, one left unsent is written over
+  DictionaryIterator *iter = outbox_unsent;
+  if (!iter)
+    app_message_outbox_begin(&iter);
+
   if (!iter) {
-    app_timer_register(1000, &handle_request_calendar_data, NULL);
+    retry_later();
     return;
   }
-  
-  dict_write_int8(iter, REQUEST_CALENDAR_KEY, event_count);
-  uint8_t clock_style = clock_is_24h_style() ? CLOCK_STYLE_24H : CLOCK_STYLE_12H;
-  dict_write_uint8(iter, CLOCK_STYLE_KEY, clock_style);
-  app_message_outbox_send();
 
-  app_timer_register(1000, &handle_request_battery_data, NULL);
- 
+  // Lowest bit first, so the calendar goes before the rest. A request that
+  // does not fit is counted and stays queued, the next one may still go.
+  uint8_t *buffer = (uint8_t *)iter->dictionary;
+  uint16_t capacity = (const uint8_t *)iter->end - buffer;
+  uint8_t request = 0;
+  for (uint8_t pending = outbox_pending; pending && !request; pending &= pending - 1) {
+    dict_write_begin(iter, buffer, capacity);
+    if (write_request(iter, pending & -pending) == DICT_OK)
+      request = pending & -pending;
+    else
+      diagnostics.outbox_write_errors++;
+  }
+  if (!request) {
+    outbox_unsent = iter;
+    retry_later();
+    return;
+  }
+  outbox_unsent = NULL;
+  // What was written, dict_size() spans the whole outbox until the send ends it
+  uint32_t size = (uint8_t *)iter->cursor - buffer;
+  trace_record_u8(TRACE_SEND, request);
+
+  // A send refused up front gets neither callback, keep the request queued.
+  // Its failure is traced at once, a replay can tell it from a late one.
+  AppMessageResult result = app_message_outbox_send();
+  if (result != APP_MSG_OK) {
+    trace_record_failed(request, result);
+    retry_later();
+    return;
+  }
+  outbox_pending &= ~request;
+  outbox_in_flight = request;
+  diagnostics.outbox_sends++;
+  diagnostics.bytes_sent += size;
+}
+
+void handle_message_sent(DictionaryIterator *sent, void *context) {
+  trace_record_u8(TRACE_SENT, outbox_in_flight);
+#ifdef TRACE
+  if (outbox_in_flight == OUTBOX_TRACE && trace_chunk_sent())
+    outbox_pending |= OUTBOX_TRACE;
+#endif
+  outbox_in_flight = 0;
+  outbox_backoff_ms = OUTBOX_RETRY_MIN_MS;
+  schedule_outbox(100);
+}
+
+static const char *link_warning() {
+  return bluetooth_connected ? "App disconnected" : "BT disconnected";
+}
+
+static void handle_link_timer(void *data) {
+  link_timer = NULL;
+  if (link_state == LINK_LOST) {
+    // Still down after the grace period
+    link_state = LINK_DOWN;
+    link_bt_lost = !bluetooth_connected;
+    // Display text in calendar view
+    show_warning(link_warning());
+    // Vibrate hard 5 times
+    generate_vibe(7);
+  } else if (link_state == LINK_SETTLING) {
+    // Held long enough, resync once
+    link_state = LINK_UP;
+    reset_outbox_backoff();
+    clear_warning();
+    calendar_request_index = 0;
+    queue_request(OUTBOX_CALENDAR | OUTBOX_BATTERY, 0);
+    // Vibrate 3 times when the watch itself was cut off
+    if (link_bt_lost)
+      generate_vibe(3);
+  }
+}
+
+static void start_link_timer(uint32_t delay_ms) {
+  if (link_timer)
+    app_timer_reschedule(link_timer, delay_ms);
+  else
+    link_timer = app_timer_register(delay_ms, &handle_link_timer, NULL);
 }
 
+static void cancel_link_timer() {
+  if (link_timer) {
+    app_timer_cancel(link_timer);
+    link_timer = NULL;
+  }
+}
+
+// Feed the Bluetooth and app state into the connection state machine
 void update_connection() {
-  // Only run when changed
- 	if(app_state_changed && !app_connected) {
-		app_state_changed = false;
-		// Display text in calendar view
-		text_layer_set_text(text_event_start_date_layer, "App disconnected");
-		text_layer_set_text(text_event_title_layer, "WARNING!");
-		text_layer_set_text(text_event_location_layer, "");
-		// Vibrate hard 5 times
-		generate_vibe(7);
-	}
-	if (!app_state_changed && app_connected) {
-		app_state_changed = true;
-		text_layer_set_text(text_event_title_layer, event[0].title);
-		text_layer_set_text(text_event_start_date_layer, event_start_date_static);
-		text_layer_set_text(text_event_location_layer, event[0].has_location ? event[0].location : "");
-		handle_request_calendar_data(NULL);
-	}
+  bool up = bluetooth_connected && app_connected;
+
+  switch (link_state) {
+    case LINK_UP:
+      if (!up) {
+        link_state = LINK_LOST;
+        start_link_timer(config.connection_grace * 1000);
+      }
+      break;
+    case LINK_LOST:
+      // Back within the grace period, nothing to show
+      if (up) {
+        link_state = LINK_UP;
+        cancel_link_timer();
+        reset_outbox_backoff();
+      }
+      break;
+    case LINK_DOWN:
+      if (up) {
+        link_state = LINK_SETTLING;
+        start_link_timer(CONNECTION_SETTLE_MS);
+      } else {
+        link_bt_lost |= !bluetooth_connected;
+        show_warning(link_warning());
+      }
+      break;
+    case LINK_SETTLING:
+      // Dropped again before it settled, stay down quietly
+      if (!up) {
+        link_state = LINK_DOWN;
+        cancel_link_timer();
+        link_bt_lost |= !bluetooth_connected;
+        show_warning(link_warning());
+      }
+      break;
+  }
 }
 
 void handle_message_fail(DictionaryIterator *failed, AppMessageResult reason, void *context) {
+    trace_record_failed(outbox_in_flight, reason);
+    // Put the request back in the queue and back off
+    outbox_pending |= outbox_in_flight;
+    outbox_in_flight = 0;
+    retry_later();
+
+    diagnostics.outbox_failures++;
+    for (int i = 0; i < DIAGNOSTICS_FAIL_REASONS; i++) {
+      if (reason & (1 << i)) {
+        diagnostics.fail_reasons[i]++;
+        break;
+      }
+    }
+
     if(reason == APP_MSG_NOT_CONNECTED){
         // Connection to smartwatch pro app NOT OK!
         app_connected = false;
@@ -256,71 +968,540 @@ void handle_message_fail(DictionaryIterator *failed, AppMessageResult reason, vo
 
 // handle BT status change related events
 void handle_bluetooth_connection(bool connected) {
-  if(!bluetooth_connected && connected) {
-		// Connection to BT OK
-    bluetooth_connected = true;
-		// Update event display
-		text_layer_set_text(text_event_title_layer, event[0].title);
-		text_layer_set_text(text_event_start_date_layer, event_start_date_static);
-		text_layer_set_text(text_event_location_layer, event[0].has_location ? event[0].location : "");
-		handle_request_calendar_data(NULL);
-		// Vibrate 3 times
-		generate_vibe(3);
-	}
-	if (bluetooth_connected && !connected) {
-		// Connection to BT NOT OK!
-		bluetooth_connected = false;
-		// Display text in calendar view
-		text_layer_set_text(text_event_start_date_layer, "BT disconnected");
-		text_layer_set_text(text_event_title_layer, "WARNING!");
-		text_layer_set_text(text_event_location_layer, "");
-		// Vibrate hard 5 times
-		generate_vibe(7);
-  }
+  trace_record_u8(TRACE_BLUETOOTH, connected);
+  bluetooth_connected = connected;
+  update_connection();
 }
 
 void set_partial_inverse(bool partial_inverse) {
+  clock_inverted = partial_inverse;
+  for (int i = 0; i < CLOCK_CELLS; i++) {
+    if (clock_cells[i])
+      layer_mark_dirty(clock_cells[i]);
+  }
+
   if (partial_inverse) {
     text_layer_set_background_color(text_date_layer, GColorWhite);
     text_layer_set_text_color(text_date_layer, GColorBlack);
-
-    text_layer_set_background_color(text_time_layer, GColorClear);
-    text_layer_set_text_color(text_time_layer, GColorBlack);
   } else {
     text_layer_set_background_color(text_date_layer, GColorClear);
     text_layer_set_text_color(text_date_layer, GColorWhite);
+  }
+}
 
-    text_layer_set_background_color(text_time_layer, GColorClear);
-    text_layer_set_text_color(text_time_layer, GColorWhite);
+// Build the view of event i, or an empty view when i is out of range
+static void build_event_view(EventView *view, int i) {
+  memset(view, 0, sizeof(EventView));
+  if (i < 0 || i >= event_count)
+    return;
+
+  strncpy(view->title, event_title(i), sizeof(view->title) - 1);
+  PROFILE_CALL(PROFILE_EVENT_DATE,
+               modify_calendar_time(view->start_date, sizeof(view->start_date), event[i].start, event[i].all_day));
+  strncpy(view->location, event_location(i), sizeof(view->location) - 1);
+}
+
+static void refresh_event_display(int i) {
+  EventView view;
+  build_event_view(&view, i);
+  if (memcmp(&view, &event_view, sizeof(EventView)) == 0)
+    return;
+  event_view = view;
+  commit_event_view();
+}
+
+static void update_event_display(int i) {
+  PROFILE_CALL(PROFILE_EVENT_DISPLAY, refresh_event_display(i));
+}
+
+// Drop the held calendar version and fetch everything again
+static void request_full_calendar() {
+  calendar_version = 0;
+  calendar_received = 0;
+  // Slots a dropped transfer filled past the events shown are free again
+  release_events_from(event_count);
+  calendar_request_index = 0;
+  queue_request(OUTBOX_CALENDAR, 200);
+}
+
+// Keep the calendar in persistent storage so a restart can draw it at once
+static void save_calendar() {
+  CalendarCache cache;
+  cache.format = PERSIST_CALENDAR_FORMAT;
+  cache.count = event_count;
+  cache.version = calendar_version;
+
+  compact_event_text();
+  cache.text_size = event_text_used;
+
+  for (int i = 0; i < event_count; i += EVENTS_PER_PERSIST) {
+    int n = event_count - i < EVENTS_PER_PERSIST ? event_count - i : EVENTS_PER_PERSIST;
+    persist_write_data(PERSIST_CALENDAR_KEY + 1 + i / EVENTS_PER_PERSIST, &event[i], n * sizeof(Event));
+  }
+  for (int i = 0; i < event_text_used; i += PERSIST_DATA_MAX_LENGTH) {
+    int n = event_text_used - i < PERSIST_DATA_MAX_LENGTH ? event_text_used - i : PERSIST_DATA_MAX_LENGTH;
+    persist_write_data(PERSIST_CALENDAR_TEXT_KEY + i / PERSIST_DATA_MAX_LENGTH, &event_text[i], n);
   }
+  persist_write_data(PERSIST_CALENDAR_KEY, &cache, sizeof(cache));
+  calendar_changed = false;
+  calendar_saved_version = calendar_version;
 }
 
-static void update_event_display() {
-	char event_start_date[BASIC_SIZE];
-	for (int i = 0; i <= event_count; i++) {
-		modify_calendar_time(event_start_date, sizeof(event_start_date), event[i].start_date, event[i].all_day);
-		strncpy(event_start_date_static, event_start_date, sizeof(event_start_date));
-		text_layer_set_text(text_event_title_layer, event[i].title);
-		text_layer_set_text(text_event_start_date_layer, event_start_date_static);
-		text_layer_set_text(text_event_location_layer, event[i].has_location ? event[i].location : "");
-		layer_mark_dirty(text_layer_get_layer(text_event_title_layer));
-		layer_mark_dirty(text_layer_get_layer(text_event_start_date_layer));
-		layer_mark_dirty(text_layer_get_layer(text_event_location_layer));
-	}
+static bool read_calendar(CalendarCache *cache) {
+  if (persist_read_data(PERSIST_CALENDAR_KEY, cache, sizeof(*cache)) != sizeof(*cache))
+    return false;
+  if (cache->format != PERSIST_CALENDAR_FORMAT || cache->count > MAX_EVENTS || cache->text_size > EVENT_TEXT_SIZE)
+    return false;
+
+  for (int i = 0; i < cache->count; i += EVENTS_PER_PERSIST) {
+    int n = cache->count - i < EVENTS_PER_PERSIST ? cache->count - i : EVENTS_PER_PERSIST;
+    if (persist_read_data(PERSIST_CALENDAR_KEY + 1 + i / EVENTS_PER_PERSIST, &event[i], n * sizeof(Event)) != (int)(n * sizeof(Event)))
+      return false;
+  }
+  for (int i = 0; i < cache->text_size; i += PERSIST_DATA_MAX_LENGTH) {
+    int n = cache->text_size - i < PERSIST_DATA_MAX_LENGTH ? cache->text_size - i : PERSIST_DATA_MAX_LENGTH;
+    if (persist_read_data(PERSIST_CALENDAR_TEXT_KEY + i / PERSIST_DATA_MAX_LENGTH, &event_text[i], n) != n)
+      return false;
+  }
+  // Text must stay inside the arena and end where the strings do
+  for (int i = 0; i < cache->count; i++) {
+    if (event[i].text_size && (event[i].text + event[i].text_size > cache->text_size ||
+        event_text[event[i].text + event[i].text_size - 1] != '\0'))
+      return false;
+  }
+  release_events_from(cache->count);
+  return event_text_held(-1) <= cache->text_size;
 }
 
-void handle_message_receive(DictionaryIterator *received, void *context) {
+static void load_calendar() {
+  CalendarCache cache;
+
+  if (!read_calendar(&cache)) {
+    release_events_from(0);
+    return;
+  }
+  event_count = cache.count;
+  event_text_used = cache.text_size;
+  calendar_version = cache.version;
+  calendar_saved_version = calendar_version;
+  release_events_from(event_count);
+}
+
+// Timed events are done once they start, all-day events at the end of the day
+static time_t event_expiry(int i) {
+  return event[i].all_day ? event[i].start + DAY_SECONDS : event[i].start;
+}
+
+static void order_events() {
+  for (int i = 0; i < event_count; i++) {
+    int j = i;
+    while (j > 0 && event[event_order[j - 1]].start > event[i].start) {
+      event_order[j] = event_order[j - 1];
+      j--;
+    }
+    event_order[j] = i;
+  }
+}
+
+// Position in event_order of the next event not yet done from position i on,
+// event_count if none. An all-day event can outlast timed events after it.
+static int next_current_event(int i) {
+  time_t now = time(NULL);
+  while (i < event_count && event_expiry(event_order[i]) <= now)
+    i++;
+  return i;
+}
+
+// Display event if first event is a "all_day"-event and the second is not.
+static int selected_event() {
+  int first = next_current_event(0);
+  if (first == event_count)
+    return -1;
+  int second = next_current_event(first + 1);
+  if (second < event_count && event[event_order[first]].all_day && !event[event_order[second]].all_day)
+    return event_order[second];
+  return event_order[first];
+}
+
+static void handle_expiry_timer(void *data);
+
+// Wake up for the next event that is done, or at midnight for the day names
+static void arm_expiry_timer() {
+  if (event_count == 0) {
+    if (expiry_timer) {
+      app_timer_cancel(expiry_timer);
+      expiry_timer = NULL;
+    }
+    return;
+  }
+
+  ensure_today();
+  time_t now = time(NULL);
+  time_t next = g_today_start + DAY_SECONDS;
+  for (int i = next_current_event(0); i < event_count; i++) {
+    time_t expiry = event_expiry(event_order[i]);
+    if (expiry > now && expiry < next)
+      next = expiry;
+  }
+
+  time_t delay = next - now;
+  if (delay > ALARM_TIMER_MAX_S)
+    delay = ALARM_TIMER_MAX_S;
+  if (expiry_timer)
+    app_timer_reschedule(expiry_timer, delay * 1000);
+  else
+    expiry_timer = app_timer_register(delay * 1000, &handle_expiry_timer, NULL);
+}
+
+static void handle_expiry_timer(void *data) {
+  expiry_timer = NULL;
+  // Paging shows the new selection when it times out
+  if (agenda_page < 0)
+    update_event_display(selected_event());
+  arm_expiry_timer();
+}
+
+static void end_agenda() {
+  if (agenda_timer) {
+    app_timer_cancel(agenda_timer);
+    agenda_timer = NULL;
+  }
+  agenda_page = -1;
+}
+
+static void show_calendar() {
+  end_agenda();
+  order_events();
+  update_event_display(selected_event());
+  schedule_alarms();
+  arm_expiry_timer();
+}
+
+#ifndef SIMPLICITY_MINIMAL
+static void handle_agenda_timeout(void *data) {
+  agenda_timer = NULL;
+  agenda_page = -1;
+  update_event_display(selected_event());
+  if (warning_shown)
+    show_warning(warning_message);
+}
+
+// Each tap shows the next cached event, no phone round trip involved
+void handle_tap(AccelAxisType axis, int32_t direction) {
+  if (event_count == 0)
+    return;
+
+  if (agenda_page < 0) {
+    int selected = selected_event();
+    agenda_page = -1;
+    for (int i = 0; i < event_count; i++) {
+      if (event_order[i] == selected)
+        agenda_page = i;
+    }
+  }
+  agenda_page = (agenda_page + 1) % event_count;
+  update_event_display(event_order[agenda_page]);
+  // The warning is not in the model, so make sure the page reaches the layers
+  commit_event_view();
+
+  if (agenda_timer)
+    app_timer_reschedule(agenda_timer, AGENDA_TIMEOUT_MS);
+  else
+    agenda_timer = app_timer_register(AGENDA_TIMEOUT_MS, &handle_agenda_timeout, NULL);
+}
+#endif
+
+// Apply a calendar response or an unprompted push from the phone.
+//
+// CALENDAR_VERSION_KEY stamps the calendar a message describes, a message
+// with only the version we already hold means nothing changed. Otherwise
+// CALENDAR_BATCH_KEY gives the calendar size and CALENDAR_RESPONSE_KEY (v1)
+// or CALENDAR_RESPONSE_V2_KEY holds a record count followed by that many
+// records, each stored in the slot named by its index. With CALENDAR_BASE_KEY the records are a
+// delta against that version: added and changed events are sent, removed
+// ones fall off the end as the size shrinks. Without a base they are
+// (part of) a full transfer.
+static void handle_calendar_response(DictionaryIterator *received) {
+  uint8_t format = CALENDAR_FORMAT_V2;
+  Tuple *records = dict_find(received, CALENDAR_RESPONSE_V2_KEY);
+  if (!records) {
+    format = CALENDAR_FORMAT_V1;
+    records = dict_find(received, CALENDAR_RESPONSE_KEY);
+  }
+  Tuple *batch = dict_find(received, CALENDAR_BATCH_KEY);
+  Tuple *version = dict_find(received, CALENDAR_VERSION_KEY);
+  Tuple *base = dict_find(received, CALENDAR_BASE_KEY);
+  uint8_t count = 0;
+
+  // A scalar shorter than its type is as malformed as a bad record
+  if ((batch && batch->length < sizeof(uint8_t)) ||
+      (version && version->length < sizeof(uint32_t)) ||
+      (base && base->length < sizeof(uint32_t))) {
+    diagnostics.decode_rejects++;
+    return;
+  }
+
+  if (!batch) {
+    if (version && version->value->uint32 != calendar_version)
+      request_full_calendar();
+    return;
+  }
+
+  if (records) {
+    // Reject the whole message rather than show half of it
+    if (records->length < 1 ||
+        !check_records(format, &records->value->data[1], records->length - 1, records->value->data[0])) {
+      diagnostics.decode_rejects++;
+      return;
+    }
+    count = records->value->data[0];
+  }
+
+  if (base) {
+    // A delta only applies on top of the calendar it was made from
+    if (base->value->uint32 != calendar_version) {
+      request_full_calendar();
+      return;
+    }
+    calendar_received = (1u << event_count) - 1;
+  } else if (count > 0 && records->value->data[1] == 0) {
+    // Full transfer starting over
+    calendar_version = 0;
+    calendar_received = 0;
+    release_events_from(event_count);
+  }
+
+  uint8_t total = batch->value->uint8;
+  if (total > MAX_EVENTS)
+    total = MAX_EVENTS;
+
+  // Decode data from phone app to memory, the record index decides the slot
+  const uint8_t *data = records ? &records->value->data[1] : NULL;
+  for (int i = 0; i < count; i++) {
+    uint8_t index;
+    Event record;
+    EventText text;
+    data += decode_event(format, data, &index, &record, &text);
+    if (index >= total)
+      continue;
+    if (store_event(index, &record, &text, ~calendar_received & ~(1u << index)))
+      calendar_changed = true;
+    calendar_received |= 1u << index;
+  }
+
+  uint32_t complete = (1u << total) - 1;
+  calendar_received &= complete;
+  if (calendar_received != complete) {
+    if (base) {
+      request_full_calendar();
+      return;
+    }
+    // Ask for the rest if the calendar did not fit in one message
+    calendar_request_index = 0;
+    while (calendar_received & (1u << calendar_request_index))
+      calendar_request_index++;
+    queue_request(OUTBOX_CALENDAR, 200);
+    return;
+  }
+
+  calendar_request_index = 0;
+  if (version)
+    calendar_version = version->value->uint32;
+
+  // The new calendar is whole, show it and free the slots past its end
+  if (event_count != total)
+    calendar_changed = true;
+  event_count = total;
+  release_events_from(event_count);
+  show_calendar();
+  // Flash wears, leave it alone when the phone sent what is already there
+  if (calendar_changed || calendar_version != calendar_saved_version)
+    save_calendar();
+}
+
+// Date and week number, on a new day or when the display settings change
+static void update_date(struct tm *t) {
+  // Need to be static because they're used by the system later.
+  static char date_text[] = "Xxxxxxxxx xxx 00 xxx";
+  static char week_text[] = "W 00";
+  int len = 0;
+
+  if (config.day_name)
+    len = snprintf(date_text, sizeof(date_text), "%s ", weekday_names[t->tm_wday]);
+  if (config.month_name)
+    snprintf(&date_text[len], sizeof(date_text) - len, "%s %2d", month_names[t->tm_mon], t->tm_mday);
+  else
+    snprintf(&date_text[len], sizeof(date_text) - len, "%02d/%02d", t->tm_mday, t->tm_mon + 1);
+
+  // Weeks run 1-53, the byte tells the compiler the text fits
+  uint8_t week = iso_week_from_tm(t);
+  snprintf(week_text, sizeof(week_text), "W%02d", week);
+  // Display date and week number on the LCD
+  text_layer_set_text(text_date_layer, date_text);
+  text_layer_set_text(text_week_layer, week_text);
+  layer_set_hidden(text_layer_get_layer(text_week_layer), !config.week_no);
+}
+
+static void handle_config_timer(void *data) {
+  config_timer = NULL;
+  persist_write_data(PERSIST_CONFIG_KEY, &config, sizeof(config));
+}
+
+// A burst of settings changes ends up as one flash write
+static void save_config_later() {
+  if (config_timer)
+    app_timer_reschedule(config_timer, PERSIST_CONFIG_MS);
+  else
+    config_timer = app_timer_register(PERSIST_CONFIG_MS, &handle_config_timer, NULL);
+}
+
+static void load_config() {
+  if (persist_read_data(PERSIST_CONFIG_KEY, &config, sizeof(config)) == sizeof(config) &&
+      config.version == PERSIST_CONFIG_VERSION)
+    return;
+
+  config = (ConfigData) {
+    .version = PERSIST_CONFIG_VERSION,
+    .invert = persist_read_bool(SETTINGS_KEY_INVERT),
+    .day_name = true,
+    .month_name = true,
+    .week_no = true,
+    .battery_step = BATTERY_STEP_DEFAULT,
+    .quiet_start = QUIET_START_DEFAULT,
+    .quiet_end = QUIET_END_DEFAULT,
+    .low_battery = LOW_BATTERY_DEFAULT,
+    .connection_grace = CONNECTION_GRACE_DEFAULT
+  };
+
+  // Only the invert setting was ever stored under its own key
+  persist_delete(SETTINGS_KEY_INVERT);
+  persist_write_data(PERSIST_CONFIG_KEY, &config, sizeof(config));
+}
+
+// Copy one setting from the message when present and in range
+static void read_setting(DictionaryIterator *received, uint32_t key, uint8_t *value, uint8_t max) {
+  Tuple *tuple = dict_find(received, key);
+  if (tuple && tuple->length >= sizeof(uint8_t) && tuple->value->uint8 <= max)
+    *value = tuple->value->uint8;
+}
+
+static bool in_quiet_hours(int hour) {
+  if (config.quiet_start == config.quiet_end)
+    return false;
+  if (config.quiet_start < config.quiet_end)
+    return hour >= config.quiet_start && hour < config.quiet_end;
+  // Quiet hours run over midnight
+  return hour >= config.quiet_start || hour < config.quiet_end;
+}
+
+static void show_battery(BatteryStatus status) {
+  battery_status = status;
+  snprintf(battery_text, sizeof(battery_text), "%d %%", battery_status.level);
+  layer_mark_dirty(battery_layer);
+}
+
+// Decide how hard to work from the hour, the watch battery and the next event
+static void update_power_policy(struct tm *t) {
+  time_t now = time(NULL);
+  BatteryChargeState charge = battery_state_service_peek();
+  uint8_t policy;
+
+  if (!t)
+    t = localtime(&now);
+
+  if (in_quiet_hours(t->tm_hour))
+    policy = POWER_QUIET;
+  else if (!charge.is_charging && charge.charge_percent <= config.low_battery)
+    policy = POWER_LOW_BATTERY;
+  else {
+    // Poll at the normal rate only when something is coming up soon
+    policy = POWER_RELAXED;
+    for (int i = 0; i < event_count; i++)
+      if (event[i].start > now && event[i].start - now <= POWER_NORMAL_AHEAD)
+        policy = POWER_NORMAL;
+  }
+
+  if (policy == power_policy)
+    return;
+
+  bool was_saving = power_policy >= POWER_LOW_BATTERY;
+  power_policy = policy;
+
+  if (was_saving && policy < POWER_LOW_BATTERY) {
+    // Catch up on what was skipped while saving
+    if (battery_layer_stale) {
+      battery_layer_stale = false;
+      show_battery(battery_pending);
+    }
+    calendar_request_index = 0;
+    queue_request(OUTBOX_CALENDAR, 500);
+  }
+}
+
+void handle_watch_battery(BatteryChargeState charge) {
+  update_power_policy(NULL);
+}
+
+void handle_message_dropped(AppMessageResult reason, void *context) {
+  trace_record_dropped(reason);
+  diagnostics.inbox_drops++;
+}
+
+static void receive_message(DictionaryIterator *received) {
 	
-  Tuple *tuple = dict_find(received, SETTINGS_RESPONSE_KEY);
+  diagnostics.bytes_received += dict_size(received);
+
+  Tuple *tuple;
+
+#ifndef SIMPLICITY_MINIMAL
+  tuple = dict_find(received, REQUEST_DIAGNOSTICS_KEY);
 
   if (tuple) {
-    tuple = dict_find(received, 100);
+    // Reply with the counters as they are now, a reset starts them over
+    diagnostics_reply = diagnostics;
+    if (tuple->length >= sizeof(uint8_t) && tuple->value->uint8 == DIAGNOSTICS_RESET)
+      memset(&diagnostics, 0, sizeof(diagnostics));
+    queue_request(OUTBOX_DIAGNOSTICS, 200);
+  }
+#endif
 
-    if (tuple) {
-      bool partial_inverse = tuple->value->uint8;
-      persist_write_bool(100, partial_inverse);
-      set_partial_inverse(partial_inverse);
+#ifdef TRACE
+  tuple = dict_find(received, REQUEST_TRACE_KEY);
+
+  if (tuple) {
+    trace_start_dump(tuple->length >= sizeof(uint8_t) && tuple->value->uint8 == TRACE_RESET);
+    queue_request(OUTBOX_TRACE, 200);
+  }
+#endif
+
+  tuple = dict_find(received, SETTINGS_RESPONSE_KEY);
+
+  if (tuple) {
+    ConfigData old = config;
+    read_setting(received, SETTINGS_KEY_INVERT, (uint8_t *)&config.invert, 1);
+    read_setting(received, SETTINGS_KEY_DAY_NAME, (uint8_t *)&config.day_name, 1);
+    read_setting(received, SETTINGS_KEY_MONTH_NAME, (uint8_t *)&config.month_name, 1);
+    read_setting(received, SETTINGS_KEY_WEEK_NO, (uint8_t *)&config.week_no, 1);
+    read_setting(received, SETTINGS_KEY_BATTERY_STEP, &config.battery_step, 100);
+    read_setting(received, SETTINGS_KEY_QUIET_START, &config.quiet_start, 23);
+    read_setting(received, SETTINGS_KEY_QUIET_END, &config.quiet_end, 23);
+    read_setting(received, SETTINGS_KEY_LOW_BATTERY, &config.low_battery, 100);
+    read_setting(received, SETTINGS_KEY_CONNECTION_GRACE, &config.connection_grace, 255);
+
+    if (memcmp(&old, &config, sizeof(config)) == 0)
+      return;
+    save_config_later();
+
+    if (config.invert != old.invert)
+      set_partial_inverse(config.invert);
+    if (config.day_name != old.day_name || config.month_name != old.month_name || config.week_no != old.week_no) {
+      time_t now = time(NULL);
+      update_date(localtime(&now));
+      show_calendar();
     }
+    if (config.battery_step != old.battery_step)
+      queue_request(OUTBOX_BATTERY, 200);
+    update_power_policy(NULL);
 
     return;
   }
@@ -328,53 +1509,66 @@ void handle_message_receive(DictionaryIterator *received, void *context) {
   tuple = dict_find(received, RECONNECT_KEY);
 
   if (tuple) {
-    app_timer_register(200, &handle_request_calendar_data, NULL);
+    calendar_request_index = 0;
+    queue_request(OUTBOX_CALENDAR | OUTBOX_BATTERY, 200);
   } else {
     Tuple *tuple = dict_find(received, CALENDAR_RESPONSE_KEY);
 
-    if (tuple) {
-        if (tuple->length % sizeof(Event) == 1) {
+    if (dict_find(received, CALENDAR_VERSION_KEY) || dict_find(received, CALENDAR_RESPONSE_V2_KEY) ||
+        (tuple && dict_find(received, CALENDAR_BATCH_KEY))) {
+      // Phone app supports batched and versioned transfers
+      handle_calendar_response(received);
+    } else if (tuple) {
+        if (tuple->length % sizeof(EventV1) == 1) {
           uint8_t count = tuple->value->data[0];
 
-          if (count == 1) {
-            // Copy data from phone app to memory
-            memcpy(&event[event_count], &tuple->value->data[1], sizeof(Event));
-            // Check if message changed from last message
-            int title_new = strcmp(event[event_count].title, last_event[event_count].title);
-            int start_date_new = strcmp(event[event_count].start_date, last_event[event_count].start_date);
-            memcpy(&last_event[event_count], &tuple->value->data[1], sizeof(Event));
-
-            // Check if second event is received 
-            if (event_count == 1){
-              // Display event if first event is a "all_day"-event and this is not.
-              if((event[0].all_day) && (!event[1].all_day)){
-                if(title_new != 0 || start_date_new != 0){
-                  // Display event on LCD
-                	update_event_display();
-                  // Set alarm on second event
-                  alarm_event = 1;                
-                }
-              }
+          // Older phone apps send one event per message
+          if (count == 1 && !check_records(CALENDAR_FORMAT_V1, &tuple->value->data[1], tuple->length - 1, 1)) {
+            diagnostics.decode_rejects++;
+          } else if (count == 1) {
+            int index = calendar_request_index;
+            uint8_t sent_index;
+            Event record;
+            EventText text;
+            // Copy data from phone app to memory, noting whether it changed
+            decode_event(CALENDAR_FORMAT_V1, &tuple->value->data[1], &sent_index, &record, &text);
+            bool changed = store_event(index, &record, &text, 0);
+            if (index >= event_count)
+              event_count = index + 1;
+
+            // The selection rule picks between the first two
+            if (changed) {
+              // Display event on LCD
+              show_calendar();
+              save_calendar();
             }
-						else {
-              if(title_new != 0 || start_date_new != 0){
-                // Display event on LCD
-                update_event_display();
-                // Set alarm on first event
-                alarm_event = 0;                
-              }
-              // Get next event 
-              event_count = 1;
-              app_timer_register(200, &handle_request_calendar_data, NULL);
+            // Get next event 
+            if (index == 0) {
+              calendar_request_index = 1;
+              queue_request(OUTBOX_CALENDAR, 200);
             }
           }
+        } else {
+          diagnostics.decode_rejects++;
         }
     } else {
       Tuple *tuple = dict_find(received, BATTERY_RESPONSE_KEY);
 
-      if (tuple) {
-        memcpy(&battery_status, &tuple->value->data[0], sizeof(BatteryStatus));
-        layer_mark_dirty(battery_layer);
+      if (tuple && tuple->length < sizeof(BatteryStatus)) {
+        diagnostics.decode_rejects++;
+      } else if (tuple) {
+        BatteryStatus status;
+        memcpy(&status, &tuple->value->data[0], sizeof(BatteryStatus));
+        bool changed = status.state != battery_status.state || status.level != battery_status.level;
+        // The phone gauge can wait while saving power. It is left as it is,
+        // as any other redraw of the window would pick up a new value.
+        if (power_policy >= POWER_LOW_BATTERY) {
+          battery_pending = status;
+          battery_layer_stale = changed;
+        } else if (changed) {
+          // Only redraw when the gauge would actually change
+          show_battery(status);
+        }
       }
     }
   }
@@ -384,19 +1578,12 @@ void handle_message_receive(DictionaryIterator *received, void *context) {
   update_connection();
 }
 
-void handle_minute_tick(struct tm *tick_time, TimeUnits units_changed) {
-  // Need to be static because they're used by the system later.
-  static char time_text[] = "00:00";
-  static char date_text[] = "Xxxxxxxxx xxx 00 xxx";
-  static char week_text[] = "W 00";
-  static char alarm_text[] = "00/00 00:00 XX";
-  static char alarm_date[] = "00/00 ";
-  static char alarm_time[] = "00:00 XX";
-
-  char *time_format;
-  char *alarm_date_format;
-  char *alarm_time_format;
+void handle_message_receive(DictionaryIterator *received, void *context) {
+  trace_record(TRACE_RECEIVE, received->dictionary, dict_size(received));
+  PROFILE_CALL(PROFILE_MESSAGE_RECEIVE, receive_message(received));
+}
 
+static void tick_minute(struct tm *tick_time) {
   if (!tick_time) {
     time_t now = time(NULL);
     tick_time = localtime(&now);
@@ -405,72 +1592,70 @@ void handle_minute_tick(struct tm *tick_time, TimeUnits units_changed) {
   // Only update if date changed
   if(tick_time->tm_mday != current_day_number){
     current_day_number = tick_time->tm_mday;
-    // Update date and week
-    strftime(week_text, sizeof(week_text), "W%V", tick_time);
-    strftime(date_text, sizeof(date_text), "%A %b %e", tick_time);
-    // Display date and week number on the LCD
-    text_layer_set_text(text_date_layer, date_text);
-    text_layer_set_text(text_week_layer, week_text);
-  }
-
-  // Set up date and time format
-  if (clock_is_24h_style()) {
-    time_format = "%R";
-    alarm_time_format = "%R";
-  } else {
-    time_format = "%I:%M";
-    alarm_time_format = "%I:%M %p";
+    update_date(tick_time);
   }
-  alarm_date_format = "%m/%d ";
-
-  strftime(time_text, sizeof(time_text), time_format, tick_time);
-  strftime(alarm_time, sizeof(alarm_time), alarm_time_format, tick_time);
-  strftime(alarm_date, sizeof(alarm_date), alarm_date_format, tick_time);
 
-  // Kludge to handle lack of non-padded hour format string
-  // for twelve hour clock.
-  if (!clock_is_24h_style() && (time_text[0] == '0')) {
-    memmove(time_text, &time_text[1], sizeof(time_text) - 1);
-  }
+  // Display new time on LCD
+  update_clock(tick_time);
 
-  // Build current time to match app alarm date/time 
-  if ((alarm_time[0] == '0')) {
-    memmove(alarm_time, &alarm_time[1], sizeof(alarm_time) - 1);
-  }
-  memcpy(&alarm_text, &alarm_date, sizeof(alarm_date));
-  strcat(alarm_text, alarm_time);
+#ifndef SIMPLICITY_MINIMAL
+  if (tick_time->tm_min == 0)
+    persist_write_data(PERSIST_DIAGNOSTICS_KEY, &diagnostics, sizeof(diagnostics));
+#endif
 
-  // Display new time on LCD
-  text_layer_set_text(text_time_layer, time_text);
+  update_power_policy(tick_time);
+  profile_tick(tick_time->tm_min);
 
-  if (strcmp(alarm_text, event[alarm_event].start_date) == 0){
-    generate_vibe(8);
+  // Check calendar version, the phone answers with only what changed
+  uint8_t poll_minutes = power_poll_minutes[power_policy];
+  if (poll_minutes && (tick_time->tm_hour * 60 + tick_time->tm_min) % poll_minutes == 0) {
+    calendar_request_index = 0;
+    queue_request(OUTBOX_CALENDAR, 500);
   }
+}
 
-  // Update calendar data
-  if (tick_time->tm_min % 10 == 0) {
-    event_count = 0; 
-    app_timer_register(500, &handle_request_calendar_data, NULL);
-  }
+void handle_minute_tick(struct tm *tick_time, TimeUnits units_changed) {
+  trace_record_tick(time(NULL));
+  PROFILE_CALL(PROFILE_MINUTE_TICK, tick_minute(tick_time));
 }
 
 void init() {
+  // Cached calendar from the last run, reconciled with the phone below
+  load_calendar();
+  load_config();
+#ifndef SIMPLICITY_MINIMAL
+  persist_read_data(PERSIST_DIAGNOSTICS_KEY, &diagnostics, sizeof(diagnostics));
+#endif
+
   window = window_create();
   window_stack_push(window, true /* Animated */);
+  profile_attach_start(window_get_root_layer(window));
   window_set_background_color(window, GColorBlack);
 
  	text_date_layer = text_layer_create(GRect(0, 94, 144, 168-94));
   text_layer_set_font(text_date_layer, fonts_get_system_font(FONT_KEY_GOTHIC_24_BOLD));
   text_layer_set_text_alignment(text_date_layer, GTextAlignmentCenter);
 
-  text_time_layer = text_layer_create(GRect(2, 112, 144-2, 168-112));
-  text_layer_set_font(text_time_layer, fonts_get_system_font(FONT_KEY_ROBOTO_BOLD_SUBSET_49));
-  text_layer_set_text_alignment(text_time_layer, GTextAlignmentCenter);
+  layer_add_child(window_get_root_layer(window), text_layer_get_layer(text_date_layer));
+
+  clock_sheet = gbitmap_create_with_resource(RESOURCE_ID_CLOCK_DIGITS);
+  for (int i = 0; i < CLOCK_GLYPHS; i++) {
+    if (i == CLOCK_GLYPH_COLON)
+      clock_glyphs[i] = gbitmap_create_as_sub_bitmap(clock_sheet, GRect(i * CLOCK_DIGIT_W, 0, CLOCK_COLON_W, CLOCK_GLYPH_H));
+    else
+      clock_glyphs[i] = gbitmap_create_as_sub_bitmap(clock_sheet, GRect(i * CLOCK_DIGIT_W, 0, CLOCK_DIGIT_W, CLOCK_GLYPH_H));
+  }
+  for (int i = 0; i < CLOCK_CELLS; i++) {
+    clock_cells[i] = layer_create_with_data(GRectZero, sizeof(int8_t));
+    *(int8_t *)layer_get_data(clock_cells[i]) = -1;
+    layer_set_update_proc(clock_cells[i], clock_cell_update_callback);
+    layer_add_child(window_get_root_layer(window), clock_cells[i]);
+  }
 
-  set_partial_inverse(persist_read_bool(100));
+  set_partial_inverse(config.invert);
 
-  layer_add_child(window_get_root_layer(window), text_layer_get_layer(text_date_layer));
-  layer_add_child(window_get_root_layer(window), text_layer_get_layer(text_time_layer));
+  time_t now = time(NULL);
+  update_clock(localtime(&now));
   
 	text_week_layer = text_layer_create(GRect(0, -5, 50, 28));
   text_layer_set_text_color(text_week_layer, GColorWhite);
@@ -479,7 +1664,7 @@ void init() {
   text_layer_set_text_alignment(text_week_layer, GTextAlignmentCenter);
   layer_add_child(window_get_root_layer(window), text_layer_get_layer(text_week_layer));
 	
-  line_layer = layer_create(layer_get_bounds(window_get_root_layer(window)));
+  line_layer = layer_create(GRect(8, 94, 124, 2));
   layer_set_update_proc(line_layer, line_layer_update_callback);
   layer_add_child(window_get_root_layer(window), line_layer);
 
@@ -489,6 +1674,7 @@ void init() {
   text_event_location_layer = text_layer_create(GRect(5, 22, layer_get_bounds(window_get_root_layer(window)).size.w - 5, 31));
   text_layer_set_text_color(text_event_location_layer, GColorWhite);
   text_layer_set_background_color(text_event_location_layer, GColorClear);
+  text_layer_set_overflow_mode(text_event_location_layer, GTextOverflowModeTrailingEllipsis);
   text_layer_set_font(text_event_location_layer, fonts_get_system_font(FONT_KEY_GOTHIC_24));
   layer_add_child(window_get_root_layer(window), text_layer_get_layer(text_event_location_layer));
 
@@ -503,13 +1689,23 @@ void init() {
   text_event_title_layer = text_layer_create(GRect(5, 42, layer_get_bounds(window_get_root_layer(window)).size.w - 5, 31));
   text_layer_set_text_color(text_event_title_layer, GColorWhite);
   text_layer_set_background_color(text_event_title_layer, GColorClear);
+  text_layer_set_overflow_mode(text_event_title_layer, GTextOverflowModeTrailingEllipsis);
   text_layer_set_font(text_event_title_layer, fonts_get_system_font(FONT_KEY_GOTHIC_24_BOLD));
   layer_add_child(window_get_root_layer(window), text_layer_get_layer(text_event_title_layer));
 
+#ifndef SIMPLICITY_MINIMAL
+  accel_tap_service_subscribe(&handle_tap);
+#endif
+
   // Init bluetooth connection handles
   bluetooth_connection_service_subscribe(&handle_bluetooth_connection);
-  //handle_bluetooth_connection(bluetooth_connection_service_peek());
 	bluetooth_connected = bluetooth_connection_service_peek();
+  // Already down at launch, show it without the grace period or vibes
+  if (!bluetooth_connected) {
+    link_state = LINK_DOWN;
+    link_bt_lost = true;
+    show_warning(link_warning());
+  }
   
   icon_battery = gbitmap_create_with_resource(RESOURCE_ID_BATTERY_ICON);
 
@@ -522,30 +1718,73 @@ void init() {
   battery_layer = layer_create(frame);
   layer_set_update_proc(battery_layer, battery_layer_update_callback);
   layer_add_child(window_get_root_layer(window), battery_layer);
+  profile_attach_end(window_get_root_layer(window));
 
   battery_status.state = 0;
   battery_status.level = -1;
 
-  app_message_open(124, 256);
+  // Follow the watch battery for the power governor
+  update_power_policy(NULL);
+  battery_state_service_subscribe(&handle_watch_battery);
+
+  // Size the inbox for a full batch of v1 events, capped to what the firmware allows
+  uint32_t header_size = dict_calc_buffer_size(4, 1, sizeof(uint8_t), sizeof(uint32_t), sizeof(uint32_t));
+  uint32_t inbox_size = header_size + MAX_EVENTS * sizeof(EventV1);
+  if (inbox_size > app_message_inbox_size_maximum())
+    inbox_size = app_message_inbox_size_maximum();
+  calendar_inbox_bytes = inbox_size - header_size;
+  calendar_batch_capacity = calendar_inbox_bytes / sizeof(EventV1);
+  if (calendar_batch_capacity > MAX_EVENTS)
+    calendar_batch_capacity = MAX_EVENTS;
+
+  app_message_open(inbox_size, OUTBOX_SIZE);
   app_message_register_inbox_received(handle_message_receive);
+  app_message_register_outbox_sent(handle_message_sent);
   app_message_register_outbox_failed(handle_message_fail);
+  app_message_register_inbox_dropped(handle_message_dropped);
 
-  event_count = 0; 
-  app_timer_register(200, &handle_request_calendar_data, NULL);
-  
+  // Draw the cached agenda on the first frame
+  show_calendar();
+
+  calendar_request_index = 0;
+  queue_request(OUTBOX_CALENDAR | OUTBOX_BATTERY, 200);
 }
 
 void deinit() {
+  end_agenda();
+  if (outbox_timer)
+    app_timer_cancel(outbox_timer);
+  cancel_link_timer();
+  if (config_timer) {
+    app_timer_cancel(config_timer);
+    handle_config_timer(NULL);
+  }
+#ifndef SIMPLICITY_MINIMAL
+  persist_write_data(PERSIST_DIAGNOSTICS_KEY, &diagnostics, sizeof(diagnostics));
+#endif
+  if (alarm_timer)
+    app_timer_cancel(alarm_timer);
+  if (expiry_timer)
+    app_timer_cancel(expiry_timer);
   app_message_deregister_callbacks();
   tick_timer_service_unsubscribe();
+#ifndef SIMPLICITY_MINIMAL
+  accel_tap_service_unsubscribe();
+#endif
   bluetooth_connection_service_unsubscribe();
+  battery_state_service_unsubscribe();
+  profile_detach();
   layer_destroy(battery_layer);
   layer_destroy(line_layer);
   text_layer_destroy(text_week_layer);
   text_layer_destroy(text_event_location_layer);
   text_layer_destroy(text_event_start_date_layer);
   text_layer_destroy(text_event_title_layer);
-  text_layer_destroy(text_time_layer);
+  for (int i = 0; i < CLOCK_CELLS; i++)
+    layer_destroy(clock_cells[i]);
+  for (int i = 0; i < CLOCK_GLYPHS; i++)
+    gbitmap_destroy(clock_glyphs[i]);
+  gbitmap_destroy(clock_sheet);
   text_layer_destroy(text_date_layer);
   gbitmap_destroy(icon_battery);
   window_destroy(window);
@@ -555,4 +1794,5 @@ int main(void) {
   init();
   app_event_loop();
   deinit();
+  return 0;
 }
\ No newline at end of file
@@ -0,0 +1,158 @@
+#ifndef trace_h
+#define trace_h
+
+#include "pebble.h"
+
+// Opt-in trace of everything that drives the face, built in with
+// ./waf configure --trace. Records go to a ring buffer, dropping the oldest
+// when it is full, and the phone reads it back with REQUEST_TRACE_KEY.
+//
+// A record is a type byte, the milliseconds since the record before as a
+// uint16 and the payload length as a uint16, then the payload, all little
+// endian. TRACE_CLOCK comes first and after any gap too long for the uint16,
+// and every tick has the time again, so a replay can start from any record.
+// TRACE_RECEIVE holds the inbox dictionary as serialized by the firmware,
+// ready to be fed back through handle_message_receive. Dictionaries larger
+// than TRACE_RECORD_MAX are recorded with no payload. A send the firmware
+// refused outright has its TRACE_FAILED in the same millisecond, callbacks
+// always come later. host/replay plays a trace back on the host.
+
+#define TRACE_CLOCK 0       // uint32 time_t, uint16 ms
+#define TRACE_RECEIVE 1     // dictionary
+#define TRACE_DROPPED 2     // uint16 AppMessageResult
+#define TRACE_SEND 3        // uint8 outbox request
+#define TRACE_SENT 4        // uint8 outbox request
+#define TRACE_FAILED 5      // uint8 outbox request, uint16 AppMessageResult
+#define TRACE_BLUETOOTH 6   // uint8 connected
+#define TRACE_TICK 7        // uint32 time_t
+#define TRACE_HEADER_SIZE 5
+#define TRACE_SIZE 3072
+#define TRACE_RECORD_MAX (TRACE_SIZE / 2)
+#define TRACE_CHUNK 32
+#define TRACE_RESET 2
+
+#ifdef TRACE
+
+static uint8_t trace_ring[TRACE_SIZE];
+static uint16_t trace_head;
+static uint16_t trace_used;
+static uint32_t trace_last_ms;
+static bool trace_started;
+// Recording stops while the trace is dumped, from trace_dump_pos on
+static bool trace_dumping;
+static bool trace_reset_after_dump;
+static uint16_t trace_dump_pos;
+
+static uint32_t trace_now_ms() {
+  time_t seconds;
+  uint16_t ms;
+  time_ms(&seconds, &ms);
+  return (uint32_t)seconds * 1000 + ms;
+}
+
+static uint8_t trace_byte(uint16_t pos) {
+  return trace_ring[(trace_head + pos) % TRACE_SIZE];
+}
+
+static void trace_write(const void *data, uint16_t length) {
+  const uint8_t *bytes = data;
+  for (int i = 0; i < length; i++)
+    trace_ring[(trace_head + trace_used++) % TRACE_SIZE] = bytes[i];
+}
+
+static void trace_drop_oldest() {
+  uint16_t size = TRACE_HEADER_SIZE + (trace_byte(3) | trace_byte(4) << 8);
+  trace_head = (trace_head + size) % TRACE_SIZE;
+  trace_used -= size;
+}
+
+static void trace_append(uint8_t type, uint16_t delta_ms, const void *data, uint16_t length) {
+  while (trace_used + TRACE_HEADER_SIZE + length > TRACE_SIZE)
+    trace_drop_oldest();
+  uint8_t header[TRACE_HEADER_SIZE] = { type, delta_ms & 0xff, delta_ms >> 8, length & 0xff, length >> 8 };
+  trace_write(header, sizeof(header));
+  trace_write(data, length);
+}
+
+static void trace_record(uint8_t type, const void *data, uint16_t length) {
+  if (trace_dumping)
+    return;
+  if (length > TRACE_RECORD_MAX)
+    length = 0;
+
+  uint32_t now = trace_now_ms();
+  if (!trace_started || now - trace_last_ms > UINT16_MAX) {
+    time_t seconds;
+    uint16_t ms;
+    time_ms(&seconds, &ms);
+    uint8_t clock[6] = { seconds & 0xff, seconds >> 8 & 0xff, seconds >> 16 & 0xff, seconds >> 24 & 0xff,
+                         ms & 0xff, ms >> 8 };
+    trace_append(TRACE_CLOCK, 0, clock, sizeof(clock));
+    trace_started = true;
+    trace_last_ms = now;
+  }
+  trace_append(type, now - trace_last_ms, data, length);
+  trace_last_ms = now;
+}
+
+static void trace_record_u8(uint8_t type, uint8_t value) {
+  trace_record(type, &value, 1);
+}
+
+static void trace_record_tick(time_t now) {
+  uint8_t seconds[4] = { now & 0xff, now >> 8 & 0xff, now >> 16 & 0xff, now >> 24 & 0xff };
+  trace_record(TRACE_TICK, seconds, sizeof(seconds));
+}
+
+static void trace_record_failed(uint8_t request, AppMessageResult reason) {
+  uint8_t payload[3] = { request, reason & 0xff, reason >> 8 & 0xff };
+  trace_record(TRACE_FAILED, payload, sizeof(payload));
+}
+
+static void trace_record_dropped(AppMessageResult reason) {
+  uint8_t payload[2] = { reason & 0xff, reason >> 8 & 0xff };
+  trace_record(TRACE_DROPPED, payload, sizeof(payload));
+}
+
+static void trace_start_dump(bool reset) {
+  trace_dumping = true;
+  trace_reset_after_dump = reset;
+  trace_dump_pos = 0;
+}
+
+// Copy the next part of the trace to out, TRACE_CHUNK long at most
+static uint16_t trace_chunk(uint8_t *out) {
+  uint16_t length = trace_used - trace_dump_pos;
+  if (length > TRACE_CHUNK)
+    length = TRACE_CHUNK;
+  for (int i = 0; i < length; i++)
+    out[i] = trace_byte(trace_dump_pos + i);
+  return length;
+}
+
+// The chunk went out, returns true while there is more to send
+static bool trace_chunk_sent() {
+  uint16_t length = trace_used - trace_dump_pos;
+  trace_dump_pos += length > TRACE_CHUNK ? TRACE_CHUNK : length;
+  if (trace_dump_pos < trace_used)
+    return true;
+  trace_dumping = false;
+  if (trace_reset_after_dump) {
+    trace_head = 0;
+    trace_used = 0;
+    trace_started = false;
+  }
+  return false;
+}
+
+#else
+
+#define trace_record(type, data, length)
+#define trace_record_u8(type, value)
+#define trace_record_tick(now)
+#define trace_record_failed(request, reason)
+#define trace_record_dropped(reason)
+
+#endif
+
+#endif
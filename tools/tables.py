@@ -0,0 +1,48 @@
+#!/usr/bin/env python
+#
+# Writes the name and week tables the face includes as tables.auto.h. Run by
+# the wscript for the watch build and by host/Makefile for the host build.
+#
+
+import sys
+
+WEEKDAY_NAMES = ['Sunday', 'Monday', 'Tuesday', 'Wednesday', 'Thursday', 'Friday', 'Saturday']
+MONTH_NAMES = ['Jan', 'Feb', 'Mar', 'Apr', 'May', 'Jun', 'Jul', 'Aug', 'Sep', 'Oct', 'Nov', 'Dec']
+
+def tables():
+    # ISO weeks counted from the Monday on or before January 1st. That week is
+    # week 1 when January 1st falls on Monday to Thursday, otherwise it belongs
+    # to the year before. Indexed by the tm_wday of January 1st.
+    week_base = []
+    for jan1 in range(7):
+        monday = (jan1 + 6) % 7
+        week_base.append(monday + (7 if monday < 4 else 0))
+    # Years starting on Thursday, and leap years starting on Wednesday, have 53
+    weeks = [[53 if jan1 == 4 or (leap and jan1 == 3) else 52 for jan1 in range(7)]
+             for leap in (False, True)]
+
+    def strings(names):
+        return ', '.join('"%s"' % name for name in names)
+
+    def numbers(values):
+        return ', '.join(str(value) for value in values)
+
+    return '\n'.join([
+        '// Generated by tools/tables.py, do not edit',
+        '#pragma once',
+        '',
+        'static const char *const weekday_names[7] = { %s };' % strings(WEEKDAY_NAMES),
+        'static const char *const month_names[12] = { %s };' % strings(MONTH_NAMES),
+        '',
+        '// (tm_yday + iso_week_base[weekday of January 1st]) / 7 is the ISO week',
+        'static const uint8_t iso_week_base[7] = { %s };' % numbers(week_base),
+        'static const uint8_t iso_weeks_in_year[2][7] = {',
+        '  { %s },' % numbers(weeks[0]),
+        '  { %s }' % numbers(weeks[1]),
+        '};',
+        ''
+    ])
+
+if __name__ == '__main__':
+    with open(sys.argv[1], 'w') as out:
+        out.write(tables())